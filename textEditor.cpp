@@ -1,725 +1,5003 @@
 #include <iostream>
 #include <cstring>
+#include <string>
 #include <fstream>
-#include <stack>
 #include <filesystem>
+#include <chrono>
+#include <atomic>
+#include <cstdlib>
+#include <cstdint>
+#include <climits>
+#include <vector>
+#include <unordered_map>
+#include <iterator>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <memory>
+#include <algorithm>
+#include <deque>
+#include <random>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <winsock2.h> // before windows.h, which would otherwise pull in the old winsock.h
+#include <afunix.h>
 #include <windows.h>
 
 
 const int BUFFER_SIZE = 100;
 
-class LineNode {
+// Collects hot-path counters and per-command latency histograms. Every hook checks `enabled`
+// first, so a disabled build pays a single predictable branch per call site.
+class Instrumentation {
 public:
-    char *text;
-    int capacity;
-    LineNode *next;
+    static const int MAX_COMMANDS = 32;
+    static const int LATENCY_BUCKETS = 24; // bucket i holds latencies in [2^i, 2^(i+1)) microseconds
 
-    LineNode(int initialCapacity = BUFFER_SIZE) : text(nullptr), capacity(initialCapacity), next(nullptr) {
-        text = new(std::nothrow) char[capacity];
-        if (text) {
-            text[0] = '\0';
-        } else {
-            std::cout << "Memory allocation failed for text." << std::endl;
+    enum IoKind { IO_LOAD, IO_SAVE, IO_SESSION_LOAD, IO_SESSION_SAVE, IO_JOURNAL, IO_AUTOSAVE, IO_CIPHER_READ, IO_CIPHER_WRITE, IO_SORT_SPILL, IO_KIND_COUNT };
+
+    static inline std::atomic<bool> enabled{false}; // read by the journal and autosave threads too
+
+    static void recordCommand(int command, long long nanoseconds) {
+        if (command < 0 || command >= MAX_COMMANDS) {
             return;
         }
+        CommandLatency &latency = commands[command];
+        long long micros = nanoseconds / 1000;
+        int bucket = 0;
+        while (bucket < LATENCY_BUCKETS - 1 && (micros >> (bucket + 1)) > 0) {
+            ++bucket;
+        }
+        ++latency.buckets[bucket];
+        ++latency.count;
+        latency.totalNanoseconds += nanoseconds;
+        if (latency.count == 1 || nanoseconds < latency.minNanoseconds) {
+            latency.minNanoseconds = nanoseconds;
+        }
+        if (nanoseconds > latency.maxNanoseconds) {
+            latency.maxNanoseconds = nanoseconds;
+        }
     }
 
-    LineNode(const LineNode &other) : capacity(other.capacity), next(nullptr) {
-        text = new(std::nothrow) char[capacity];
-        if (text) {
-            strcpy(text, other.text);
-        } else {
-            std::cout << "Memory allocation failed for text." << std::endl;
+    // Allocations, copies and I/O may happen on background threads, hence the atomic counters.
+    static void recordAllocation(size_t bytes) {
+        if (enabled) {
+            allocations.fetch_add(1, std::memory_order_relaxed);
+            allocatedBytes.fetch_add(bytes, std::memory_order_relaxed);
         }
+    }
 
-        if (other.next) {
-            next = new LineNode(*other.next);
+    static void recordCopy(size_t bytes) {
+        if (enabled) {
+            copiedBytes.fetch_add(bytes, std::memory_order_relaxed);
         }
     }
 
-    ~LineNode() {
-        delete[] text;
-        text = nullptr;
+    static void recordIo(IoKind kind, size_t bytes, long long nanoseconds) {
+        if (enabled) {
+            io[kind].calls.fetch_add(1, std::memory_order_relaxed);
+            io[kind].bytes.fetch_add(bytes, std::memory_order_relaxed);
+            io[kind].nanoseconds.fetch_add(nanoseconds, std::memory_order_relaxed);
+        }
     }
 
-    friend std::ostream &operator<<(std::ostream &out, const LineNode &lineNode) {
-        out << lineNode.text;
-        return out;
+    static void addUndoMemory(size_t bytes) {
+        undoBytes += bytes;
+        if (undoBytes > peakUndoBytes) {
+            peakUndoBytes = undoBytes;
+        }
     }
-};
 
+    static void removeUndoMemory(size_t bytes) {
+        undoBytes = bytes > undoBytes ? 0 : undoBytes - bytes;
+    }
 
-class Text {
-private:
-    LineNode *head;
-    LineNode *tail;
-
-public:
-    Text() : head(nullptr), tail(nullptr) {}
+    static long long now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
 
-    Text(const Text &other) : head(nullptr), tail(nullptr) {
-        LineNode *current = other.head;
-        while (current) {
-            appendLine(current->text);
-            current = current->next;
+    static void print(std::ostream &out, const char *const *commandNames, int commandCount) {
+        out << "Command latencies (microseconds):" << std::endl;
+        bool anyCommand = false;
+        for (int i = 1; i <= commandCount && i < MAX_COMMANDS; ++i) {
+            const CommandLatency &latency = commands[i];
+            if (latency.count == 0) {
+                continue;
+            }
+            anyCommand = true;
+            out << "  " << i << ". " << commandNames[i] << ": count " << latency.count
+                << ", mean " << latency.totalNanoseconds / latency.count / 1000
+                << ", min " << latency.minNanoseconds / 1000
+                << ", max " << latency.maxNanoseconds / 1000
+                << ", p50 <" << percentileBound(latency, 50)
+                << ", p99 <" << percentileBound(latency, 99) << std::endl;
+        }
+        if (!anyCommand) {
+            out << "  No commands recorded yet." << std::endl;
         }
-    }
 
-    ~Text() {
-        clear();
+        out << "Memory:" << std::endl
+            << "  allocations: " << allocations << " (" << allocatedBytes << " bytes)" << std::endl
+            << "  bytes copied: " << copiedBytes << std::endl
+            << "  undo/redo history: " << undoBytes << " bytes (peak " << peakUndoBytes << ")" << std::endl;
+
+        out << "I/O:" << std::endl;
+        for (int kind = 0; kind < IO_KIND_COUNT; ++kind) {
+            out << "  " << IO_NAMES[kind] << ": " << io[kind].calls << " calls, " << io[kind].bytes << " bytes, "
+                << io[kind].nanoseconds / 1000 << " us" << std::endl;
+        }
     }
 
-    void appendLine(const char *line) {
-        LineNode *newNode = new LineNode(strlen(line) + 1);
-        if (!newNode->text) {
-            std::cout << "Memory allocation failed for new line." << std::endl;
-            delete newNode;
-            return;
+    // Writes the counters as a single JSON object so that scripts can collect them after a session.
+    static bool dumpToFile(const char *path, const char *const *commandNames, int commandCount) {
+        std::ofstream out(path);
+        if (!out) {
+            return false;
         }
-        strcpy(newNode->text, line);
-        if (!head) {
-            head = tail = newNode;
-        } else {
-            tail->next = newNode;
-            tail = newNode;
+        out << "{\n  \"commands\": [";
+        bool first = true;
+        for (int i = 1; i <= commandCount && i < MAX_COMMANDS; ++i) {
+            const CommandLatency &latency = commands[i];
+            if (latency.count == 0) {
+                continue;
+            }
+            out << (first ? "\n" : ",\n") << "    {\"id\": " << i << ", \"name\": \"" << commandNames[i]
+                << "\", \"count\": " << latency.count << ", \"total_ns\": " << latency.totalNanoseconds
+                << ", \"min_ns\": " << latency.minNanoseconds << ", \"max_ns\": " << latency.maxNanoseconds
+                << ", \"histogram_us_log2\": [";
+            for (int bucket = 0; bucket < LATENCY_BUCKETS; ++bucket) {
+                out << (bucket ? ", " : "") << latency.buckets[bucket];
+            }
+            out << "]}";
+            first = false;
         }
+        out << (first ? "],\n" : "\n  ],\n")
+            << "  \"allocations\": " << allocations << ",\n"
+            << "  \"allocated_bytes\": " << allocatedBytes << ",\n"
+            << "  \"copied_bytes\": " << copiedBytes << ",\n"
+            << "  \"undo_bytes\": " << undoBytes << ",\n"
+            << "  \"peak_undo_bytes\": " << peakUndoBytes << ",\n"
+            << "  \"io\": {";
+        for (int kind = 0; kind < IO_KIND_COUNT; ++kind) {
+            out << (kind ? ", " : "") << "\"" << IO_NAMES[kind] << "\": {\"calls\": " << io[kind].calls
+                << ", \"bytes\": " << io[kind].bytes << ", \"ns\": " << io[kind].nanoseconds << "}";
+        }
+        out << "}\n}\n";
+        return out.good();
     }
 
-    void clear() {
-        LineNode *current = head;
-        while (current) {
-            LineNode *toDelete = current;
-            current = current->next;
-            delete toDelete;
+private:
+    struct CommandLatency {
+        unsigned long long count;
+        long long totalNanoseconds;
+        long long minNanoseconds;
+        long long maxNanoseconds;
+        unsigned long long buckets[LATENCY_BUCKETS];
+    };
+
+    struct IoCounters {
+        std::atomic<unsigned long long> calls;
+        std::atomic<unsigned long long> bytes;
+        std::atomic<long long> nanoseconds;
+    };
+
+    static constexpr const char *IO_NAMES[IO_KIND_COUNT] = {"load", "save", "session_load", "session_save", "journal",
+                                                            "autosave", "cipher_read", "cipher_write", "sort_spill"};
+
+    static inline CommandLatency commands[MAX_COMMANDS] = {};
+    static inline IoCounters io[IO_KIND_COUNT] = {};
+    static inline std::atomic<unsigned long long> allocations = 0;
+    static inline std::atomic<unsigned long long> allocatedBytes = 0;
+    static inline std::atomic<unsigned long long> copiedBytes = 0;
+    static inline size_t undoBytes = 0;
+    static inline size_t peakUndoBytes = 0;
+
+    static long long percentileBound(const CommandLatency &latency, int percentile) {
+        unsigned long long target = (latency.count * percentile + 99) / 100;
+        unsigned long long seen = 0;
+        for (int bucket = 0; bucket < LATENCY_BUCKETS; ++bucket) {
+            seen += latency.buckets[bucket];
+            if (seen >= target) {
+                return 1LL << (bucket + 1);
+            }
         }
-        head = tail = nullptr;
+        return 1LL << LATENCY_BUCKETS;
     }
+};
 
-    friend std::ostream &operator<<(std::ostream &out, const Text &text) {
-        LineNode *current = text.head;
-        while (current) {
-            out << *current << std::endl;
-            current = current->next;
+class ColdBlock;
+
+// A read-only view of a whole file. Cold blocks loaded from a session point straight into the
+// view, each holding a reference; the file stays mapped until the last of them goes away.
+// Opening a file that is still mapped returns the same view, and a block that is already loaded
+// from it is handed out again, so lists read at different times share their blocks.
+// Blocks may die on background threads, so the block registry is guarded by registryMutex.
+class MappedFile {
+public:
+    const char *data;
+    size_t size;
+
+    static inline std::recursive_mutex registryMutex;
+
+    static MappedFile *open(const char *path) {
+        std::error_code error;
+        std::filesystem::path target = std::filesystem::absolute(path, error);
+        {
+            std::lock_guard<std::recursive_mutex> lock(registryMutex);
+            for (MappedFile *mapped: openFiles) {
+                if (mapped->path == target && mapped->retainIfAlive()) {
+                    return mapped;
+                }
+            }
         }
-        return out;
+        HANDLE file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                 FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            return nullptr;
+        }
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+            CloseHandle(file);
+            return nullptr;
+        }
+        HANDLE mapping = CreateFileMapping(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping) {
+            CloseHandle(file);
+            return nullptr;
+        }
+        const void *view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!view) {
+            CloseHandle(mapping);
+            CloseHandle(file);
+            return nullptr;
+        }
+        MappedFile *mapped = new MappedFile(file, mapping, static_cast<const char *>(view), fileSize.QuadPart, target);
+        std::lock_guard<std::recursive_mutex> lock(registryMutex);
+        openFiles.push_back(mapped);
+        return mapped;
     }
 
-    LineNode *getHead() const {
-        return head;
+    void retain() {
+        references.fetch_add(1, std::memory_order_relaxed);
     }
 
-    void setHead(LineNode *node) {
-        head = node;
+    void release() {
+        if (references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            delete this;
+        }
     }
-};
 
+    const std::filesystem::path &getPath() const {
+        return path;
+    }
 
-class Cursor {
-private:
-    int lineIndex;
-    int charIndex;
-public:
-    Cursor(int line = 0, int ch = 0) : lineIndex(line), charIndex(ch) {}
+    size_t attach(ColdBlock *block, const char *compressed) {
+        std::lock_guard<std::recursive_mutex> lock(registryMutex);
+        blocks.push_back(block);
+        slots[compressed] = blocks.size() - 1;
+        retain();
+        return blocks.size() - 1;
+    }
 
-    int getLine() const { return lineIndex; }
+    void detach(size_t slot, const char *compressed) {
+        std::lock_guard<std::recursive_mutex> lock(registryMutex);
+        blocks[slot] = nullptr;
+        auto entry = slots.find(compressed);
+        if (entry != slots.end() && entry->second == slot) {
+            slots.erase(entry);
+        }
+        release();
+    }
 
-    int getChar() const { return charIndex; }
+    // Returns the block whose compressed bytes start at `compressed` in the view, with a reference for the
+    // caller: the one already loaded if its sizes match, otherwise a new one.
+    ColdBlock *blockAt(const char *compressed, size_t compressedSize, size_t rawSize, int lineCount);
+
+    // Copies every block still pointing into a mapping of `path` to the heap, so that the file
+    // can be overwritten (Windows refuses to truncate a file while a view of it is open).
+    static void detachPath(const char *path);
+
+    // Windows cannot remove a file while a view of it is open either.
+    static bool isOpen(const char *path) {
+        std::error_code error;
+        std::filesystem::path target = std::filesystem::absolute(path, error);
+        std::lock_guard<std::recursive_mutex> lock(registryMutex);
+        return std::any_of(openFiles.begin(), openFiles.end(), [&target](const MappedFile *file) {
+            return file->path == target;
+        });
+    }
 
-    void move(int line, int ch) {
-        lineIndex = line;
-        charIndex = ch;
+private:
+    HANDLE file;
+    HANDLE mapping;
+    std::atomic<int> references;
+    std::filesystem::path path;
+    std::vector<ColdBlock *> blocks;
+    std::unordered_map<const char *, size_t> slots; // newest block for each position in the view
+
+    static inline std::vector<MappedFile *> openFiles;
+
+    // Fails once the last reference is gone and the view is on its way out on another thread.
+    bool retainIfAlive() {
+        int count = references.load(std::memory_order_relaxed);
+        while (count > 0 && !references.compare_exchange_weak(count, count + 1, std::memory_order_relaxed)) {
+        }
+        return count > 0;
     }
 
-    void display() const {
-        std::cout << "Cursor is at line " << lineIndex + 1 << ", position " << charIndex + 1 << "." << std::endl;
+    MappedFile(HANDLE fileHandle, HANDLE mappingHandle, const char *view, size_t length,
+               const std::filesystem::path &filePath)
+            : data(view), size(length), file(fileHandle), mapping(mappingHandle), references(1),
+              path(filePath) {}
+
+    ~MappedFile() {
+        UnmapViewOfFile(data);
+        CloseHandle(mapping);
+        CloseHandle(file);
+        std::lock_guard<std::recursive_mutex> lock(registryMutex);
+        for (size_t i = 0; i < openFiles.size(); ++i) {
+            if (openFiles[i] == this) {
+                openFiles.erase(openFiles.begin() + i);
+                break;
+            }
+        }
     }
 };
 
-class PathValidator {
+
+// A small LZ77 codec in the spirit of LZ4: sequences of literals followed by a back-reference
+// of at least MIN_MATCH bytes. It favours speed over ratio, which suits text that is decoded
+// every time a cold block is printed or searched.
+class LzCodec {
 public:
-    static const size_t MAX_PATH_LENGTH = 260;
+    // No compressed byte decodes to more raw bytes than this: a length byte of 255 is the densest encoding.
+    static const size_t MAX_EXPANSION = 255;
 
-    bool isValidInputPath(const char* path) {
-        std::ifstream infile(path);
-        return infile.good();
+    static size_t maxCompressedSize(size_t rawSize) {
+        return rawSize + rawSize / 255 + 16;
     }
 
-    bool isValidOutputPath(const char* path) {
-        std::filesystem::path fsPath(path);
+    // `dst` must hold at least maxCompressedSize(rawSize) bytes. Returns the compressed size.
+    static size_t compress(const char *src, size_t rawSize, char *dst) {
+        const unsigned char *in = reinterpret_cast<const unsigned char *>(src);
+        unsigned char *out = reinterpret_cast<unsigned char *>(dst);
+        unsigned int table[1 << HASH_BITS] = {}; // position + 1 of the last sequence with this hash, 0 if none
+
+        size_t anchor = 0;
+        size_t pos = 0;
+        size_t outPos = 0;
+        while (rawSize >= MIN_MATCH && pos <= rawSize - MIN_MATCH) {
+            unsigned int sequence = read32(in + pos);
+            unsigned int hash = (sequence * 2654435761u) >> (32 - HASH_BITS);
+            size_t candidate = table[hash];
+            table[hash] = static_cast<unsigned int>(pos + 1);
+
+            if (candidate && pos - (candidate - 1) <= MAX_OFFSET && read32(in + candidate - 1) == sequence) {
+                size_t matchPos = candidate - 1;
+                size_t matchLen = MIN_MATCH;
+                while (pos + matchLen < rawSize && in[matchPos + matchLen] == in[pos + matchLen]) {
+                    ++matchLen;
+                }
+                outPos = emitSequence(out, outPos, in + anchor, pos - anchor, pos - matchPos, matchLen);
+                pos += matchLen;
+                anchor = pos;
+            } else {
+                ++pos;
+            }
+        }
+        if (anchor < rawSize) {
+            outPos = emitSequence(out, outPos, in + anchor, rawSize - anchor, 0, 0);
+        }
+        return outPos;
+    }
 
-        if (fsPath.has_parent_path()) {
-            if (!std::filesystem::exists(fsPath.parent_path())) {
+    // Decodes exactly `rawSize` bytes into `dst`. Returns false if the input is malformed.
+    static bool decompress(const char *src, size_t compressedSize, char *dst, size_t rawSize) {
+        const unsigned char *in = reinterpret_cast<const unsigned char *>(src);
+        unsigned char *out = reinterpret_cast<unsigned char *>(dst);
+        size_t inPos = 0;
+        size_t outPos = 0;
+        while (outPos < rawSize) {
+            if (inPos >= compressedSize) {
+                return false;
+            }
+            unsigned char token = in[inPos++];
+            size_t literalLen = token >> 4;
+            if (literalLen == 15 && !readLength(in, compressedSize, inPos, literalLen)) {
+                return false;
+            }
+            if (literalLen > compressedSize - inPos || literalLen > rawSize - outPos) {
+                return false;
+            }
+            memcpy(out + outPos, in + inPos, literalLen);
+            inPos += literalLen;
+            outPos += literalLen;
+            if (outPos == rawSize) {
+                break;
+            }
+
+            if (compressedSize - inPos < 2) {
+                return false;
+            }
+            size_t offset = in[inPos] | (in[inPos + 1] << 8);
+            inPos += 2;
+            size_t matchLen = token & 15;
+            if (matchLen == 15 && !readLength(in, compressedSize, inPos, matchLen)) {
                 return false;
             }
+            matchLen += MIN_MATCH;
+            if (offset == 0 || offset > outPos || matchLen > rawSize - outPos) {
+                return false;
+            }
+            const unsigned char *match = out + outPos - offset;
+            for (size_t i = 0; i < matchLen; ++i) { // byte by byte, matches may overlap their own output
+                out[outPos + i] = match[i];
+            }
+            outPos += matchLen;
         }
+        return true;
+    }
 
-        // check if the file can be created or opened
-        std::ofstream outfile(path, std::ios::app);
-        bool canCreate = outfile.good();
-        outfile.close();
-        return canCreate;
+private:
+    static const int HASH_BITS = 13;
+    static const size_t MIN_MATCH = 4;
+    static const size_t MAX_OFFSET = 0xFFFF;
+
+    static unsigned int read32(const unsigned char *p) {
+        unsigned int value;
+        memcpy(&value, p, sizeof(value));
+        return value;
     }
-};
 
-class CaesarCipher {
-public:
-    CaesarCipher(const char* dllPath) {
-        handle = LoadLibrary(TEXT(dllPath));
-        if (!handle || handle == INVALID_HANDLE_VALUE) {
-            throw std::runtime_error("Library was not found");
+    static size_t writeLength(unsigned char *out, size_t outPos, size_t length) {
+        while (length >= 255) {
+            out[outPos++] = 255;
+            length -= 255;
         }
+        out[outPos++] = static_cast<unsigned char>(length);
+        return outPos;
+    }
 
-        encryption = (encryption_ptr) GetProcAddress(handle, TEXT("encrypt"));
-        if (!encryption) {
-            FreeLibrary(handle);
-            throw std::runtime_error("Function 'encrypt' was not found");
+    static bool readLength(const unsigned char *in, size_t size, size_t &inPos, size_t &length) {
+        unsigned char byte;
+        do {
+            if (inPos >= size) {
+                return false;
+            }
+            byte = in[inPos++];
+            length += byte;
+        } while (byte == 255);
+        return true;
+    }
+
+    // A match length of 0 marks the trailing literal-only sequence.
+    static size_t emitSequence(unsigned char *out, size_t outPos, const unsigned char *literals, size_t literalLen,
+                               size_t offset, size_t matchLen) {
+        size_t matchCode = matchLen ? matchLen - MIN_MATCH : 0;
+        out[outPos++] = static_cast<unsigned char>(((literalLen < 15 ? literalLen : 15) << 4) |
+                                                   (matchCode < 15 ? matchCode : 15));
+        if (literalLen >= 15) {
+            outPos = writeLength(out, outPos, literalLen - 15);
+        }
+        memcpy(out + outPos, literals, literalLen);
+        outPos += literalLen;
+        if (matchLen) {
+            out[outPos++] = static_cast<unsigned char>(offset & 0xFF);
+            out[outPos++] = static_cast<unsigned char>(offset >> 8);
+            if (matchCode >= 15) {
+                outPos = writeLength(out, outPos, matchCode - 15);
+            }
         }
+        return outPos;
+    }
+};
 
-        decryption = (decryption_ptr) GetProcAddress(handle, TEXT("decrypt"));
-        if (!decryption) {
-            FreeLibrary(handle);
-            throw std::runtime_error ("Function 'decrypt' was not found");
+
+// An immutable, compressed run of lines. The raw payload is every line followed by '\0'.
+// Blocks are shared by reference count between the live text and undo snapshots.
+class ColdBlock {
+public:
+    static const int MAX_LINES = 256;
+    static const size_t MAX_RAW_SIZE = 64 * 1024;
+
+    int lineCount;
+    size_t rawSize;
+    size_t compressedSize;
+    const char *data;
+
+    static ColdBlock *compress(const char *raw, size_t rawSize, int lineCount) {
+        char *scratch = new(std::nothrow) char[LzCodec::maxCompressedSize(rawSize)];
+        if (!scratch) {
+            std::cout << "Memory allocation failed for compressed block." << std::endl;
+            return nullptr;
+        }
+        size_t compressedSize = LzCodec::compress(raw, rawSize, scratch);
+        char *compressed = new(std::nothrow) char[compressedSize ? compressedSize : 1];
+        if (!compressed) {
+            std::cout << "Memory allocation failed for compressed block." << std::endl;
+            delete[] scratch;
+            return nullptr;
         }
+        memcpy(compressed, scratch, compressedSize);
+        Instrumentation::recordAllocation(compressedSize);
+        delete[] scratch;
+        return new ColdBlock(lineCount, rawSize, compressedSize, compressed, nullptr);
     }
 
-    ~CaesarCipher() {
-        if (handle) {
-            FreeLibrary(handle);
+    // Wraps compressed bytes that live inside `file` without copying them.
+    static ColdBlock *fromMapping(MappedFile *file, const char *compressed, size_t compressedSize, size_t rawSize,
+                                  int lineCount) {
+        return new ColdBlock(lineCount, rawSize, compressedSize, compressed, file);
+    }
+
+    void detachFromMapping() {
+        char *copy = new char[compressedSize ? compressedSize : 1];
+        memcpy(copy, data, compressedSize);
+        const char *view = data;
+        data = copy;
+        MappedFile *file = mapping;
+        mapping = nullptr;
+        file->detach(mappingSlot, view);
+    }
+
+    // The file `data` points into, or null for a block on the heap. Only the thread running commands may ask,
+    // as it is the one that detaches blocks.
+    const MappedFile *getMapping() const {
+        return mapping;
+    }
+
+    void retain() {
+        references.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Like MappedFile::retainIfAlive, for a block found in a registry.
+    bool retainIfAlive() {
+        int count = references.load(std::memory_order_relaxed);
+        while (count > 0 && !references.compare_exchange_weak(count, count + 1, std::memory_order_relaxed)) {
         }
+        return count > 0;
     }
 
-    void processFile(const char* inputFilePath, const char* outputFilePath, int shift, bool isEncryption) {
-        processFileInternal(inputFilePath, outputFilePath, shift, isEncryption ? encryption : decryption);
+    void release();
+
+    // Snapshot readers decode on other threads while an edit may detach the block from its
+    // session file, so the source is read under the registry lock and its mapping kept open until
+    // decoding is done.
+    bool decompressInto(char *raw) const {
+        MappedFile *file;
+        const char *source;
+        {
+            std::lock_guard<std::recursive_mutex> lock(MappedFile::registryMutex);
+            file = mapping;
+            source = data;
+            if (file) {
+                file->retain();
+            }
+        }
+        bool decoded = LzCodec::decompress(source, compressedSize, raw, rawSize);
+        if (file) {
+            file->release();
+        }
+        return decoded;
     }
 
 private:
-    HINSTANCE handle;
-    typedef char* (*encryption_ptr)(const char*, int);
-    typedef char* (*decryption_ptr)(const char*, int);
-    encryption_ptr encryption;
-    decryption_ptr decryption;
+    std::atomic<int> references; // snapshots are released on background threads
+    MappedFile *mapping; // owner of `data` when the block was loaded from a session file
+    size_t mappingSlot;
+
+    ColdBlock(int lines, size_t raw, size_t compressed, const char *bytes, MappedFile *file)
+            : lineCount(lines), rawSize(raw), compressedSize(compressed), data(bytes), references(1), mapping(file),
+              mappingSlot(file ? file->attach(this, bytes) : 0) {}
+
+    ~ColdBlock() {
+        std::lock_guard<std::recursive_mutex> lock(MappedFile::registryMutex); // detachPath may be moving `data`
+        if (mapping) {
+            mapping->detach(mappingSlot, data);
+        } else {
+            delete[] data;
+        }
+    }
+};
 
-    static const size_t CHUNK_SIZE = 128;
 
-    void processFileInternal(const char* inputFilePath, const char* outputFilePath, int shift, char* (*process)(const char*, int)) {
-        std::ifstream inputFile(inputFilePath, std::ios::binary);
-        if (!inputFile.is_open()) {
-            std::cout << "Failed to open input file. Please, make sure path exists." << std::endl;
-            return;
+// Keeps the most recently used cold blocks decompressed, so that printing or searching around
+// the same region does not decode a block for every line.
+class ColdBlockCache {
+public:
+    struct Entry {
+        const ColdBlock *block;
+        char *raw;
+        size_t *offsets; // lineCount + 1 entries, offsets[i + 1] - offsets[i] - 1 is the length of line i
+        unsigned long long lastUse;
+    };
+
+    // Only the thread running commands (holding the document lock exclusively) reads through the
+    // cache, background readers decode into their own buffers, so an entry stays valid until the next call.
+    static const Entry *get(const ColdBlock *block) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Entry *victim = &entries[0];
+        for (Entry &entry: entries) {
+            if (entry.block == block) {
+                entry.lastUse = ++clock;
+                return &entry;
+            }
+            if (entry.lastUse < victim->lastUse) {
+                victim = &entry;
+            }
         }
 
-        std::ofstream outputFile(outputFilePath, std::ios::binary);
-        if (!outputFile.is_open()){
-            std::cout << "Failed to open output file. Please, make sure path exists." << std::endl;
-            inputFile.close();
-            return;
+        clearEntry(*victim);
+        victim->raw = new(std::nothrow) char[block->rawSize ? block->rawSize : 1];
+        victim->offsets = new(std::nothrow) size_t[block->lineCount + 1];
+        if (!victim->raw || !victim->offsets || !block->decompressInto(victim->raw)) {
+            std::cout << "Failed to decompress a text block." << std::endl;
+            clearEntry(*victim);
+            return nullptr;
+        }
+        Instrumentation::recordAllocation(block->rawSize);
+        Instrumentation::recordCopy(block->rawSize);
+
+        size_t offset = 0;
+        for (int line = 0; line < block->lineCount; ++line) {
+            victim->offsets[line] = offset;
+            const char *end = static_cast<const char *>(memchr(victim->raw + offset, '\0', block->rawSize - offset));
+            if (!end) {
+                std::cout << "Text block is corrupted." << std::endl;
+                clearEntry(*victim);
+                return nullptr;
+            }
+            offset = end - victim->raw + 1;
         }
+        victim->offsets[block->lineCount] = offset;
+        victim->block = block;
+        victim->lastUse = ++clock;
+        return victim;
+    }
 
-        char buffer[CHUNK_SIZE + 1];
-        while (inputFile.read(buffer, CHUNK_SIZE) || inputFile.gcount() > 0) {
-            size_t bytesRead = inputFile.gcount();
-            buffer[bytesRead] = '\0';
-            char* processedContent = process(buffer, shift);
-            if (processedContent) {
-                processedContent[bytesRead] = '\0';
-                outputFile.write(processedContent, bytesRead);
-                delete[] processedContent;
-            } else {
-                std::cout << "Processing failed for chunk." << std::endl;
-                break;
+    static void evict(const ColdBlock *block) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (Entry &entry: entries) {
+            if (entry.block == block) {
+                clearEntry(entry);
             }
         }
-        inputFile.close();
-        outputFile.close();
     }
-};
 
-class TextManager {
-public:
-    static const int MAX_FILENAME_LENGTH = 21;
+private:
+    static const int CAPACITY = 8;
 
-    TextManager() : currentLine(nullptr), clipboard(nullptr), cursor(0, 0) {}
+    static inline Entry entries[CAPACITY] = {};
+    static inline unsigned long long clock = 0;
+    static inline std::mutex mutex;
 
-    ~TextManager() {
-        freeClipboard();
+    static void clearEntry(Entry &entry) {
+        delete[] entry.raw;
+        delete[] entry.offsets;
+        entry = {nullptr, nullptr, nullptr, 0};
+    }
+};
+
+inline void ColdBlock::release() {
+    if (references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        ColdBlockCache::evict(this);
+        delete this;
+    }
+}
+
+inline ColdBlock *MappedFile::blockAt(const char *compressed, size_t compressedSize, size_t rawSize, int lineCount) {
+    std::lock_guard<std::recursive_mutex> lock(registryMutex);
+    auto slot = slots.find(compressed);
+    if (slot != slots.end()) {
+        ColdBlock *block = blocks[slot->second];
+        if (block->compressedSize == compressedSize && block->rawSize == rawSize && block->lineCount == lineCount &&
+            block->retainIfAlive()) {
+            return block;
+        }
+    }
+    return ColdBlock::fromMapping(this, compressed, compressedSize, rawSize, lineCount);
+}
+
+inline void MappedFile::detachPath(const char *path) {
+    std::filesystem::path target = std::filesystem::absolute(path);
+    std::lock_guard<std::recursive_mutex> lock(registryMutex);
+    for (size_t i = 0; i < openFiles.size(); ++i) {
+        MappedFile *file = openFiles[i];
+        if (file->path != target) {
+            continue;
+        }
+        openFiles.erase(openFiles.begin() + i); // the file is about to change, so open() must map it anew
+        file->retain(); // keep the view alive while its last blocks move out
+        for (ColdBlock *block: file->blocks) {
+            if (block) {
+                block->detachFromMapping();
+            }
+        }
+        file->blocks.clear();
+        file->slots.clear();
+        file->release();
+        return;
+    }
+}
+
+
+class LineNode {
+public:
+    char *text;
+    int capacity;
+    LineNode *next;
+    ColdBlock *cold; // when set, this node stands for all lines of the block and `text` is null
+
+    LineNode(int initialCapacity = BUFFER_SIZE) : text(nullptr), capacity(initialCapacity), next(nullptr),
+                                                  cold(nullptr) {
+        text = new(std::nothrow) char[capacity];
+        if (text) {
+            text[0] = '\0';
+        } else {
+            std::cout << "Memory allocation failed for text." << std::endl;
+            return;
+        }
+    }
+
+    // Takes over the caller's reference to `block`.
+    explicit LineNode(ColdBlock *block) : text(nullptr), capacity(0), next(nullptr), cold(block) {}
+
+    LineNode(const LineNode &other) : text(nullptr), capacity(other.capacity), next(nullptr), cold(other.cold) {
+        if (cold) {
+            cold->retain();
+        } else {
+            text = new(std::nothrow) char[capacity];
+            if (text) {
+                strcpy(text, other.text);
+            } else {
+                std::cout << "Memory allocation failed for text." << std::endl;
+            }
+        }
+
+        if (other.next) {
+            next = new LineNode(*other.next);
+        }
+    }
+
+    ~LineNode() {
+        delete[] text;
+        text = nullptr;
+        if (cold) {
+            cold->release();
+        }
+    }
+
+    int lineCount() const {
+        return cold ? cold->lineCount : 1;
+    }
+
+    friend std::ostream &operator<<(std::ostream &out, const LineNode &lineNode) {
+        out << lineNode.text;
+        return out;
+    }
+};
+
+
+class Text {
+public:
+    // Where a block starts, as stored in a session file. Thawing a block keeps its first node, so the entries
+    // stay right until lines are inserted or removed.
+    struct IndexEntry {
+        int firstLine;
+        LineNode *node;
+    };
+
+private:
+    LineNode *head;
+    LineNode *tail;
+    std::vector<IndexEntry> lineIndex; // empty unless the text was loaded from a session and has kept its lines
+
+public:
+    Text() : head(nullptr), tail(nullptr) {}
+
+    Text(const Text &other) : head(nullptr), tail(nullptr) {
+        if (other.head) {
+            setHead(new LineNode(*other.head));
+        }
+    }
+
+    ~Text() {
+        clear();
+    }
+
+    void appendLine(const char *line) {
+        LineNode *newNode = new LineNode(strlen(line) + 1);
+        if (!newNode->text) {
+            std::cout << "Memory allocation failed for new line." << std::endl;
+            delete newNode;
+            return;
+        }
+        strcpy(newNode->text, line);
+        appendNode(newNode);
+    }
+
+    // Appends a compressed run of lines; takes over the caller's reference to `block`.
+    void appendBlock(ColdBlock *block) {
+        appendNode(new LineNode(block));
+    }
+
+    // Returns the node holding line `index`, or nullptr if there is no such line. A cold block
+    // containing the line is decompressed into ordinary nodes first, so the result is always editable.
+    LineNode *lineAt(int index) {
+        LineNode *current = head;
+        int firstLine = 0;
+        auto entry = std::upper_bound(lineIndex.begin(), lineIndex.end(), index,
+                                      [](int line, const IndexEntry &indexEntry) { return line < indexEntry.firstLine; });
+        if (entry != lineIndex.begin()) {
+            --entry;
+            current = entry->node;
+            firstLine = entry->firstLine;
+        }
+        while (current && firstLine + current->lineCount() <= index) {
+            firstLine += current->lineCount();
+            current = current->next;
+        }
+        if (!current || index < 0) {
+            return nullptr;
+        }
+        if (current->cold && !thaw(current)) {
+            return nullptr;
+        }
+        for (; firstLine < index; ++firstLine) {
+            current = current->next;
+        }
+        return current;
+    }
+
+    // Returns the node holding the last line, decompressing its block if it is cold, or nullptr for an empty text.
+    LineNode *lastLine() {
+        if (tail && tail->cold && !thaw(tail)) {
+            return nullptr;
+        }
+        return tail;
+    }
+
+    int lineCount() const {
+        int count = 0;
+        for (LineNode *current = head; current; current = current->next) {
+            count += current->lineCount();
+        }
+        return count;
+    }
+
+    // Calls visit(line, length) for every line from `first` on, decompressing cold blocks through
+    // the cache. Stops early and returns false as soon as the visitor returns false. Background
+    // threads pass useCache = false and decode each block into a private buffer instead. The first
+    // `skipLines` lines are passed over, without decoding the blocks that hold only skipped lines.
+    template<typename Visitor>
+    static bool forEachLine(const LineNode *first, Visitor visit, bool useCache = true, int skipLines = 0) {
+        std::vector<char> buffer;
+        for (const LineNode *current = first; current; current = current->next) {
+            if (skipLines >= current->lineCount()) {
+                skipLines -= current->lineCount();
+                continue;
+            }
+            if (!current->cold) {
+                if (!visit(static_cast<const char *>(current->text), strlen(current->text))) {
+                    return false;
+                }
+                continue;
+            }
+            if (!useCache) {
+                buffer.resize(current->cold->rawSize);
+                if (!current->cold->decompressInto(buffer.data())) {
+                    return false;
+                }
+                const char *line = buffer.data();
+                const char *end = buffer.data() + buffer.size();
+                for (int i = 0; i < current->cold->lineCount && line < end; ++i) {
+                    size_t length = strnlen(line, end - line);
+                    if (i >= skipLines && !visit(line, length)) {
+                        return false;
+                    }
+                    line += length + 1;
+                }
+                skipLines = 0;
+                continue;
+            }
+            const ColdBlockCache::Entry *entry = ColdBlockCache::get(current->cold);
+            if (!entry) {
+                return false;
+            }
+            int firstLine = skipLines;
+            skipLines = 0;
+            for (int line = firstLine; line < current->cold->lineCount; ++line) {
+                size_t offset = entry->offsets[line];
+                if (!visit(static_cast<const char *>(entry->raw + offset), entry->offsets[line + 1] - offset - 1)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    void clear() {
+        LineNode *current = head;
+        while (current) {
+            LineNode *toDelete = current;
+            current = current->next;
+            delete toDelete;
+        }
+        head = tail = nullptr;
+        lineIndex.clear();
+    }
+
+    friend std::ostream &operator<<(std::ostream &out, const Text &text) {
+        forEachLine(text.head, [&out](const char *line, size_t length) {
+            out.write(line, length) << '\n';
+            return true;
+        });
+        return out;
+    }
+
+    LineNode *getHead() const {
+        return head;
+    }
+
+    // The last node, which may be a cold block; see lastLine() for an editable last line.
+    LineNode *getTail() const {
+        return tail;
+    }
+
+    void setHead(LineNode *node) {
+        head = tail = node;
+        while (tail && tail->next) {
+            tail = tail->next;
+        }
+        lineIndex.clear();
+    }
+
+    // Takes over a list loaded from a session file together with its block index.
+    void setHead(LineNode *node, std::vector<IndexEntry> index) {
+        setHead(node);
+        lineIndex = std::move(index);
+    }
+
+    void insertAfter(LineNode *node, LineNode *newNode) {
+        newNode->next = node->next;
+        node->next = newNode;
+        if (tail == node) {
+            tail = newNode;
+        }
+        lineIndex.clear(); // the lines after `node` have moved down
+    }
+
+private:
+    void appendNode(LineNode *node) {
+        if (!head) {
+            head = tail = node;
+        } else {
+            tail->next = node;
+            tail = node;
+        }
+    }
+
+    // Replaces a cold node in place by one ordinary node per line of its block.
+    bool thaw(LineNode *node) {
+        const ColdBlockCache::Entry *entry = ColdBlockCache::get(node->cold);
+        if (!entry) {
+            return false;
+        }
+        ColdBlock *block = node->cold;
+        LineNode *last = node;
+        LineNode *rest = node->next;
+        for (int line = 1; line < block->lineCount; ++line) {
+            const char *lineText = entry->raw + entry->offsets[line];
+            LineNode *newNode = new LineNode(strlen(lineText) + 1);
+            strcpy(newNode->text, lineText);
+            last->next = newNode;
+            last = newNode;
+        }
+        last->next = rest;
+        if (tail == node) {
+            tail = last;
+        }
+
+        const char *firstText = entry->raw;
+        node->capacity = strlen(firstText) + 1;
+        node->text = new char[node->capacity];
+        strcpy(node->text, firstText);
+        node->cold = nullptr;
+        block->release(); // may evict `entry`, so this comes last
+        return true;
+    }
+};
+
+
+// Line, word and byte counts of a text, as `wc` reports them for the saved file: bytes include the '\n' written
+// after every line, and words are runs of bytes other than spaces and \t\n\v\f\r. Counts are taken when a text is
+// built and then adjusted by every edit, so reading them costs nothing; sessions store them too, so that loading
+// does not have to decode the blocks. `valid` is false when the counts are not known and have to be taken again.
+class TextStats {
+public:
+    long long lines;
+    long long words;
+    long long bytes;
+    bool valid;
+
+    TextStats() : lines(0), words(0), bytes(0), valid(true) {}
+
+    static TextStats unknown() {
+        TextStats stats;
+        stats.valid = false;
+        return stats;
+    }
+
+    static bool isSpace(unsigned char c) {
+        return c == ' ' || (c >= '\t' && c <= '\r');
+    }
+
+    void addLine(const char *line, size_t length) {
+        ++lines;
+        words += countWordStarts(line, length, true);
+        bytes += length + 1;
+    }
+
+    void add(const TextStats &other) {
+        lines += other.lines;
+        words += other.words;
+        bytes += other.bytes;
+        valid = valid && other.valid;
+    }
+
+    void removeLine(const char *line, size_t length) {
+        --lines;
+        words -= countWordStarts(line, length, true);
+        bytes -= length + 1;
+    }
+
+    // Accounts for `line` (of `lineLength` bytes) getting `removed` bytes at `pos` replaced by `inserted`. Only
+    // the changed bytes and their two neighbours are looked at.
+    void splice(const char *line, size_t lineLength, size_t pos, size_t removed, const char *inserted,
+                size_t insertedLength) {
+        bool afterSpace = pos == 0 || isSpace(line[pos - 1]);
+        size_t next = pos + removed;
+        bool nextStartsWord = next < lineLength && !isSpace(line[next]);
+        auto wordStarts = [afterSpace, nextStartsWord](const char *segment, size_t length) {
+            long long count = countWordStarts(segment, length, afterSpace);
+            bool endsInSpace = length ? isSpace(segment[length - 1]) : afterSpace;
+            return count + (nextStartsWord && endsInSpace ? 1 : 0);
+        };
+        words += wordStarts(inserted, insertedLength) - wordStarts(line + pos, removed);
+        bytes += static_cast<long long>(insertedLength) - static_cast<long long>(removed);
+    }
+
+    // Counts the bytes that begin a word; `afterSpace` tells whether the byte before `data` was a space.
+    static size_t countWordStarts(const char *data, size_t size, bool afterSpace) {
+        const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+        size_t count = 0;
+        size_t pos = 0;
+#ifdef __SSE2__
+        const __m128i blank = _mm_set1_epi8(' ');
+        const __m128i firstControl = _mm_set1_epi8('\t');
+        const __m128i controlRange = _mm_set1_epi8('\r' - '\t');
+        const __m128i zero = _mm_setzero_si128();
+        unsigned carry = afterSpace ? 1 : 0;
+        while (pos + 16 <= size) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes + pos));
+            // c - '\t' <= '\r' - '\t' as unsigned bytes, tested by a saturating subtraction reaching zero
+            __m128i control = _mm_cmpeq_epi8(_mm_subs_epu8(_mm_sub_epi8(chunk, firstControl), controlRange), zero);
+            unsigned spaces = _mm_movemask_epi8(_mm_or_si128(control, _mm_cmpeq_epi8(chunk, blank)));
+            unsigned starts = ~spaces & ((spaces << 1) | carry) & 0xFFFF;
+            count += __builtin_popcount(starts);
+            carry = spaces >> 15;
+            pos += 16;
+        }
+        afterSpace = carry != 0;
+#endif
+        for (; pos < size; ++pos) {
+            bool space = isSpace(bytes[pos]);
+            if (!space && afterSpace) {
+                ++count;
+            }
+            afterSpace = space;
+        }
+        return count;
+    }
+};
+
+
+// Packs incoming lines into cold blocks appended to a Text. Input may arrive in arbitrary chunks;
+// a line is only emitted once its '\n' (or the end of input) has been seen.
+class BlockBuilder {
+public:
+    explicit BlockBuilder(Text &target) : text(target), lineCount(0) {}
+
+    ~BlockBuilder() {
+        finish();
+    }
+
+    void addBytes(const char *data, size_t size) {
+        size_t pos = 0;
+        while (pos < size) {
+            const char *newline = static_cast<const char *>(memchr(data + pos, '\n', size - pos));
+            if (!newline) {
+                pending.append(data + pos, size - pos);
+                return;
+            }
+            size_t length = newline - (data + pos);
+            if (pending.empty()) {
+                addLine(data + pos, length);
+            } else {
+                pending.append(data + pos, length);
+                addLine(pending.data(), pending.size());
+                pending.clear();
+            }
+            pos += length + 1;
+        }
+    }
+
+    void addLine(const char *line, size_t length) {
+        length = strnlen(line, length); // the block payload uses '\0' as separator
+        if (length > 0 && line[length - 1] == '\r') {
+            --length;
+        }
+        raw.append(line, length);
+        raw.push_back('\0');
+        stats.addLine(line, length);
+        ++lineCount;
+        if (lineCount == ColdBlock::MAX_LINES || raw.size() >= ColdBlock::MAX_RAW_SIZE) {
+            flushBlock();
+        }
+    }
+
+    // Counts of the lines added so far.
+    const TextStats &getStats() const {
+        return stats;
+    }
+
+    // Emits a trailing line without '\n' and the last partially filled block.
+    void finish() {
+        if (!pending.empty()) {
+            addLine(pending.data(), pending.size());
+            pending.clear();
+        }
+        flushBlock();
+    }
+
+private:
+    Text &text;
+    std::string raw;
+    std::string pending;
+    int lineCount;
+    TextStats stats;
+
+    void flushBlock() {
+        if (lineCount == 0) {
+            return;
+        }
+        ColdBlock *block = ColdBlock::compress(raw.data(), raw.size(), lineCount);
+        if (block) {
+            text.appendBlock(block);
+        }
+        raw.clear();
+        lineCount = 0;
+    }
+};
+
+
+class Cursor {
+private:
+    int lineIndex;
+    int charIndex;
+public:
+    Cursor(int line = 0, int ch = 0) : lineIndex(line), charIndex(ch) {}
+
+    int getLine() const { return lineIndex; }
+
+    int getChar() const { return charIndex; }
+
+    void move(int line, int ch) {
+        lineIndex = line;
+        charIndex = ch;
+    }
+
+    void display() const {
+        std::cout << "Cursor is at line " << lineIndex + 1 << ", position " << charIndex + 1 << "." << std::endl;
+    }
+};
+
+
+// UTF-8 helpers. A byte that does not start a valid sequence counts as one character on its own,
+// so any byte string has a well-defined length in characters and nothing has to be rejected.
+class Utf8 {
+public:
+    // Returns the length of the valid sequence at `s`, 0 if the bytes there are not valid UTF-8
+    // and -1 if they start a valid sequence that `available` cuts short. Reading stops at the first
+    // byte that does not fit, so a '\0'-terminated string is never read past its terminator.
+    static int sequenceLength(const unsigned char *s, size_t available) {
+        unsigned char lead = s[0];
+        if (lead < 0x80) {
+            return 1;
+        }
+        int length;
+        unsigned char low = 0x80; // the second byte range excludes overlong forms and surrogates
+        unsigned char high = 0xBF;
+        if (lead >= 0xC2 && lead <= 0xDF) {
+            length = 2;
+        } else if (lead >= 0xE0 && lead <= 0xEF) {
+            length = 3;
+            low = lead == 0xE0 ? 0xA0 : 0x80;
+            high = lead == 0xED ? 0x9F : 0xBF;
+        } else if (lead >= 0xF0 && lead <= 0xF4) {
+            length = 4;
+            low = lead == 0xF0 ? 0x90 : 0x80;
+            high = lead == 0xF4 ? 0x8F : 0xBF;
+        } else {
+            return 0;
+        }
+        for (int i = 1; i < length; ++i) {
+            if (static_cast<size_t>(i) >= available) {
+                return -1;
+            }
+            if (s[i] < low || s[i] > high) {
+                return 0;
+            }
+            low = 0x80;
+            high = 0xBF;
+        }
+        return length;
+    }
+
+    // Returns the number of leading bytes of `data` that form complete, valid sequences.
+    static size_t validPrefix(const char *data, size_t size) {
+        const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+        size_t pos = 0;
+        while (true) {
+            pos = asciiRun(bytes, pos, size, false);
+            if (pos == size) {
+                return size;
+            }
+            int length = sequenceLength(bytes + pos, size - pos);
+            if (length <= 0) {
+                return pos;
+            }
+            pos += length;
+        }
+    }
+
+    // Moves `pos` over up to `count` characters of the '\0'-terminated `text` that start before
+    // `limit`, and returns how many it moved over. `limit` must not exceed the readable buffer.
+    static size_t advance(const char *text, size_t &pos, size_t limit, size_t count) {
+        const unsigned char *bytes = reinterpret_cast<const unsigned char *>(text);
+        size_t moved = 0;
+        while (moved < count && pos < limit && bytes[pos] != '\0') {
+            size_t runLimit = count - moved < limit - pos ? pos + (count - moved) : limit;
+            size_t runEnd = asciiRun(bytes, pos, runLimit, true);
+            moved += runEnd - pos;
+            pos = runEnd;
+            if (pos == runLimit || bytes[pos] == '\0') {
+                continue;
+            }
+            int length = sequenceLength(bytes + pos, 4);
+            pos += length > 0 ? length : 1;
+            ++moved;
+        }
+        return moved;
+    }
+
+private:
+    // Returns the position of the first byte in [pos, limit) that is not ASCII (or is '\0' when
+    // `stopAtNul` is set), or `limit`. Sixteen bytes are checked at a time where SSE2 is available.
+    static size_t asciiRun(const unsigned char *bytes, size_t pos, size_t limit, bool stopAtNul) {
+#ifdef __SSE2__
+        const __m128i zero = _mm_setzero_si128();
+        while (pos + 16 <= limit) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes + pos));
+            int mask = _mm_movemask_epi8(chunk); // the top bit is set exactly for non-ASCII bytes
+            if (stopAtNul) {
+                mask |= _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, zero));
+            }
+            if (mask) {
+                return pos + __builtin_ctz(mask);
+            }
+            pos += 16;
+        }
+#endif
+        while (pos < limit && bytes[pos] < 0x80 && !(stopAtNul && bytes[pos] == 0)) {
+            ++pos;
+        }
+        return pos;
+    }
+};
+
+// Validates a byte stream that arrives in chunks; a sequence split between chunks is carried over.
+class Utf8Validator {
+public:
+    Utf8Validator() : pendingLength(0), offset(0), failed(false), failure(0) {}
+
+    void feed(const char *data, size_t size) {
+        size_t pos = 0;
+        if (!failed && pendingLength > 0) {
+            size_t taken = std::min(size, sizeof(pending) - pendingLength);
+            memcpy(pending + pendingLength, data, taken);
+            int length = Utf8::sequenceLength(pending, pendingLength + taken);
+            if (length == 0) {
+                fail(offset - pendingLength);
+            } else if (length > 0) {
+                pos = length - pendingLength;
+                pendingLength = 0;
+            } else {
+                pendingLength += taken;
+                pos = size;
+            }
+        }
+        if (!failed && pos < size) {
+            pos += Utf8::validPrefix(data + pos, size - pos);
+            if (pos < size) {
+                if (Utf8::sequenceLength(reinterpret_cast<const unsigned char *>(data) + pos, size - pos) < 0) {
+                    pendingLength = size - pos;
+                    memcpy(pending, data + pos, pendingLength);
+                } else {
+                    fail(offset + pos);
+                }
+            }
+        }
+        offset += size;
+    }
+
+    // Call once the stream has ended; returns whether all of it was valid.
+    bool finish() {
+        if (!failed && pendingLength > 0) {
+            fail(offset - pendingLength);
+        }
+        return !failed;
+    }
+
+    size_t errorOffset() const {
+        return failure;
+    }
+
+private:
+    unsigned char pending[4];
+    size_t pendingLength;
+    size_t offset;
+    bool failed;
+    size_t failure;
+
+    void fail(size_t at) {
+        failed = true;
+        failure = at;
+        pendingLength = 0;
+    }
+};
+
+// Maps character columns to byte offsets on recently used lines. For each line it keeps the byte
+// offset of every CHECKPOINT_INTERVAL-th character, computed lazily only as far as lookups have
+// reached, so a lookup decodes at most CHECKPOINT_INTERVAL characters past the nearest checkpoint.
+// Lines are identified by their node: an edit must call invalidate() for its line, and clear()
+// must be called whenever nodes of the document are freed.
+class ColumnIndex {
+public:
+    static const size_t CHECKPOINT_INTERVAL = 64;
+    static const size_t MAX_LINES = 16;
+    static const size_t NOT_FOUND = SIZE_MAX;
+
+    ColumnIndex() : useCounter(0) {}
+
+    // Returns the byte offset of character `column` of `line`, or NOT_FOUND if the line is shorter.
+    // The end of the line is a valid column.
+    size_t byteOffset(const LineNode *line, size_t column) {
+        Entry &entry = lookup(line);
+        extend(entry, line, column, NOT_FOUND);
+        size_t index = std::min(column / CHECKPOINT_INTERVAL, entry.checkpoints.size() - 1);
+        size_t pos = entry.checkpoints[index];
+        size_t wanted = column - index * CHECKPOINT_INTERVAL;
+        if (Utf8::advance(line->text, pos, line->capacity, wanted) < wanted) {
+            return NOT_FOUND;
+        }
+        return pos;
+    }
+
+    // Returns the number of characters of `line` that start before byte `offset`.
+    size_t column(const LineNode *line, size_t offset) {
+        Entry &entry = lookup(line);
+        extend(entry, line, NOT_FOUND, offset);
+        size_t index = std::upper_bound(entry.checkpoints.begin(), entry.checkpoints.end(), offset) -
+                       entry.checkpoints.begin() - 1;
+        size_t pos = entry.checkpoints[index];
+        size_t limit = std::min(offset, static_cast<size_t>(line->capacity));
+        return index * CHECKPOINT_INTERVAL + Utf8::advance(line->text, pos, limit, NOT_FOUND);
+    }
+
+    size_t columnCount(const LineNode *line) {
+        Entry &entry = lookup(line);
+        extend(entry, line, NOT_FOUND, NOT_FOUND);
+        size_t pos = entry.checkpoints.back();
+        return (entry.checkpoints.size() - 1) * CHECKPOINT_INTERVAL +
+               Utf8::advance(line->text, pos, line->capacity, NOT_FOUND);
+    }
+
+    // Drops what an edit starting at byte `from` of `line` may have changed. Decoding a character
+    // looks at most three bytes ahead, so checkpoints that close to the edit go as well.
+    void invalidate(const LineNode *line, size_t from) {
+        for (Entry &entry: entries) {
+            if (entry.line != line) {
+                continue;
+            }
+            while (entry.checkpoints.size() > 1 && entry.checkpoints.back() + 3 > from) {
+                entry.checkpoints.pop_back();
+            }
+            entry.complete = false;
+        }
+    }
+
+    void clear() {
+        entries.clear();
+    }
+
+private:
+    struct Entry {
+        const LineNode *line;
+        std::vector<size_t> checkpoints; // checkpoints[i] is the byte offset of character i * CHECKPOINT_INTERVAL
+        bool complete; // the last checkpoint is within CHECKPOINT_INTERVAL characters of the line end
+        unsigned long long lastUse;
+    };
+
+    std::vector<Entry> entries;
+    unsigned long long useCounter;
+
+    Entry &lookup(const LineNode *line) {
+        Entry *slot = nullptr;
+        for (Entry &entry: entries) {
+            if (entry.line == line) {
+                entry.lastUse = ++useCounter;
+                return entry;
+            }
+            if (!slot || entry.lastUse < slot->lastUse) {
+                slot = &entry;
+            }
+        }
+        if (entries.size() < MAX_LINES) {
+            entries.push_back(Entry());
+            slot = &entries.back();
+        }
+        slot->line = line;
+        slot->checkpoints.assign(1, 0);
+        slot->complete = false;
+        slot->lastUse = ++useCounter;
+        return *slot;
+    }
+
+    // Adds checkpoints until one covers `column` or lies past byte `offset`, or the line ends.
+    void extend(Entry &entry, const LineNode *line, size_t column, size_t offset) {
+        while (!entry.complete && entry.checkpoints.size() - 1 < column / CHECKPOINT_INTERVAL &&
+               entry.checkpoints.back() <= offset) {
+            size_t pos = entry.checkpoints.back();
+            if (Utf8::advance(line->text, pos, line->capacity, CHECKPOINT_INTERVAL) < CHECKPOINT_INTERVAL) {
+                entry.complete = true;
+            } else {
+                entry.checkpoints.push_back(pos);
+            }
+        }
+    }
+};
+
+// Line diff between two versions of a text, printed as a unified diff. A version is either a line list (the text
+// or an undo step) or a file. While diffing only a 64-bit hash of each line is kept, and lines with equal hashes
+// count as equal; the text of changed lines and their context is read a second time when the hunks are printed.
+//
+// The edit script comes from Myers' O(ND) algorithm in its linear-space form: the middle snake of a shortest
+// edit path splits the problem in two halves until they are trivial. Before the search, common first and last
+// lines are trimmed (for two line lists whole shared blocks are skipped without decoding them), and lines that
+// do not occur on the other side at all are set aside as changed. A search that costs more than the cost limit
+// splits at the furthest point it reached, so a heavily changed input stays fast but may not get a minimal diff.
+class LineDiff {
+public:
+    static const int CONTEXT_LINES = 3;
+    static const long long MIN_COST_LIMIT = 1024;
+
+    struct Source {
+        enum Kind { EMPTY, LIST, TEXT_FILE };
+
+        Kind kind;
+        const LineNode *lines;
+        FILE *file;
+        std::string label;
+
+        // An empty text or undo step has a null list and no lines.
+        static Source ofList(const LineNode *lines, const std::string &label) {
+            return {lines ? LIST : EMPTY, lines, nullptr, label};
+        }
+
+        static Source ofFile(FILE *file, const std::string &label) {
+            return {TEXT_FILE, nullptr, file, label};
+        }
+    };
+
+    // Prints the changes that turn `from` into `to` and returns the number of hunks.
+    static size_t print(std::ostream &out, const Source &from, const Source &to) {
+        Side a{&from, 0, 0, {}};
+        Side b{&to, 0, 0, {}};
+        size_t suffix = 0;
+        if (from.kind == Source::LIST && to.kind == Source::LIST) {
+            skipSharedNodes(a, b, suffix);
+        } else {
+            a.total = countLines(from);
+            b.total = countLines(to);
+        }
+        hashMiddle(a, suffix);
+        hashMiddle(b, suffix);
+
+        std::vector<bool> deleted;
+        std::vector<bool> inserted;
+        LineDiff().compute(a.hashes, b.hashes, deleted, inserted);
+
+        std::vector<Hunk> hunks;
+        collectHunks(a, b, deleted, inserted, hunks);
+        if (hunks.empty()) {
+            return 0;
+        }
+
+        std::vector<std::pair<size_t, size_t>> rangesA;
+        std::vector<std::pair<size_t, size_t>> rangesB;
+        for (const Hunk &hunk: hunks) {
+            rangesA.push_back({hunk.a0, hunk.a1});
+            rangesB.push_back({hunk.b0, hunk.b1});
+        }
+        std::vector<std::string> linesA;
+        std::vector<std::string> linesB;
+        readRanges(from, rangesA, linesA);
+        readRanges(to, rangesB, linesB);
+
+        out << "--- " << from.label << "\n+++ " << to.label << "\n";
+        size_t nextA = 0;
+        size_t nextB = 0;
+        for (const Hunk &hunk: hunks) {
+            out << "@@ -";
+            printRange(out, hunk.a0, hunk.a1);
+            out << " +";
+            printRange(out, hunk.b0, hunk.b1);
+            out << " @@\n";
+            size_t i = hunk.a0;
+            size_t j = hunk.b0;
+            while (i < hunk.a1 || j < hunk.b1) {
+                if (i < hunk.a1 && isChanged(deleted, a.prefix, i)) {
+                    out << '-' << lineAt(linesA, nextA) << '\n';
+                    ++i;
+                } else if (j < hunk.b1 && isChanged(inserted, b.prefix, j)) {
+                    out << '+' << lineAt(linesB, nextB) << '\n';
+                    ++j;
+                } else {
+                    out << ' ' << lineAt(linesA, nextA) << '\n';
+                    ++nextB;
+                    ++i;
+                    ++j;
+                }
+            }
+        }
+        out.flush();
+        return hunks.size();
+    }
+
+    // Calls visit(line, length) for every line of `file` from its current position, splitting and trimming lines
+    // the same way BlockBuilder does when the file is loaded. Returns false if `visit` stopped early.
+    template<typename Visitor>
+    static bool forEachFileLine(FILE *file, Visitor visit) {
+        std::vector<char> buffer(1 << 20);
+        std::string pending;
+        size_t chunkSize;
+        while ((chunkSize = fread(buffer.data(), 1, buffer.size(), file)) > 0) {
+            size_t pos = 0;
+            while (pos < chunkSize) {
+                const char *start = buffer.data() + pos;
+                const char *newline = static_cast<const char *>(memchr(start, '\n', chunkSize - pos));
+                if (!newline) {
+                    pending.append(start, chunkSize - pos);
+                    break;
+                }
+                size_t length = newline - start;
+                bool more;
+                if (pending.empty()) {
+                    more = visit(start, trimmedLength(start, length));
+                } else {
+                    pending.append(start, length);
+                    more = visit(pending.data(), trimmedLength(pending.data(), pending.size()));
+                    pending.clear();
+                }
+                if (!more) {
+                    return false;
+                }
+                pos += length + 1;
+            }
+        }
+        if (!pending.empty()) {
+            return visit(pending.data(), trimmedLength(pending.data(), pending.size()));
+        }
+        return true;
+    }
+
+    static uint64_t hashLine(const char *line, size_t length) {
+        uint64_t hash = 0x9E3779B97F4A7C15ull ^ length;
+        size_t i = 0;
+        for (; i + 8 <= length; i += 8) {
+            uint64_t word;
+            memcpy(&word, line + i, 8);
+            hash = (hash ^ word) * 0xFF51AFD7ED558CCDull;
+            hash ^= hash >> 32;
+        }
+        uint64_t tail = 0;
+        memcpy(&tail, line + i, length - i);
+        hash = (hash ^ tail) * 0xC4CEB9FE1A85EC53ull;
+        return hash ^ (hash >> 29);
+    }
+
+    // Marks the lines of `a` that are deleted and the lines of `b` that are inserted to turn `a` into `b`.
+    void compute(const std::vector<uint64_t> &a, const std::vector<uint64_t> &b, std::vector<bool> &deleted,
+                 std::vector<bool> &inserted) {
+        deleted.assign(a.size(), false);
+        inserted.assign(b.size(), false);
+        size_t aLo = 0;
+        size_t bLo = 0;
+        size_t aHi = a.size();
+        size_t bHi = b.size();
+        while (aLo < aHi && bLo < bHi && a[aLo] == b[bLo]) {
+            ++aLo;
+            ++bLo;
+        }
+        while (aLo < aHi && bLo < bHi && a[aHi - 1] == b[bHi - 1]) {
+            --aHi;
+            --bHi;
+        }
+
+        // a line without a counterpart on the other side is changed in every edit script
+        std::vector<uint64_t> keptA;
+        std::vector<uint64_t> keptB;
+        std::vector<size_t> indexA;
+        std::vector<size_t> indexB;
+        keepShared(a, aLo, aHi, b, bLo, bHi, deleted, keptA, indexA);
+        keepShared(b, bLo, bHi, a, aLo, aHi, inserted, keptB, indexB);
+
+        std::vector<Range> pending = {{0, static_cast<long long>(keptA.size()), 0,
+                                       static_cast<long long>(keptB.size())}};
+        while (!pending.empty()) {
+            Range range = pending.back();
+            pending.pop_back();
+            while (range.aLo < range.aHi && range.bLo < range.bHi && keptA[range.aLo] == keptB[range.bLo]) {
+                ++range.aLo;
+                ++range.bLo;
+            }
+            while (range.aLo < range.aHi && range.bLo < range.bHi && keptA[range.aHi - 1] == keptB[range.bHi - 1]) {
+                --range.aHi;
+                --range.bHi;
+            }
+            long long x = 0;
+            long long y = 0;
+            if (range.aLo == range.aHi || range.bLo == range.bHi ||
+                !bisect(keptA.data() + range.aLo, range.aHi - range.aLo, keptB.data() + range.bLo,
+                        range.bHi - range.bLo, x, y) || x + y == 0 ||
+                (x == range.aHi - range.aLo && y == range.bHi - range.bLo)) {
+                for (long long i = range.aLo; i < range.aHi; ++i) {
+                    deleted[indexA[i]] = true;
+                }
+                for (long long j = range.bLo; j < range.bHi; ++j) {
+                    inserted[indexB[j]] = true;
+                }
+                continue;
+            }
+            pending.push_back({range.aLo, range.aLo + x, range.bLo, range.bLo + y});
+            pending.push_back({range.aLo + x, range.aHi, range.bLo + y, range.bHi});
+        }
+    }
+
+private:
+    struct Side {
+        const Source *source;
+        size_t prefix; // leading lines shared with the other side, not hashed
+        size_t total;
+        std::vector<uint64_t> hashes; // lines from `prefix` on, except the shared trailing ones
+    };
+
+    struct Range {
+        long long aLo;
+        long long aHi;
+        long long bLo;
+        long long bHi;
+    };
+
+    // Line ranges [a0, a1) and [b0, b1) printed as one hunk, context included.
+    struct Hunk {
+        size_t a0;
+        size_t a1;
+        size_t b0;
+        size_t b1;
+    };
+
+    std::vector<long long> forward;
+    std::vector<long long> backward;
+
+    static size_t trimmedLength(const char *line, size_t length) {
+        length = strnlen(line, length);
+        if (length > 0 && line[length - 1] == '\r') {
+            --length;
+        }
+        return length;
+    }
+
+    static size_t countLines(const Source &source) {
+        size_t count = 0;
+        for (const LineNode *node = source.lines; node; node = node->next) {
+            count += node->lineCount();
+        }
+        return count;
+    }
+
+    static bool sameNode(const LineNode *a, const LineNode *b) {
+        if (a->cold || b->cold) {
+            return a->cold == b->cold;
+        }
+        return strcmp(a->text, b->text) == 0;
+    }
+
+    // An undo step shares the blocks it did not change with the text, so common leading and trailing nodes are
+    // found by pointer and skipped without being decoded.
+    static void skipSharedNodes(Side &a, Side &b, size_t &suffix) {
+        std::vector<const LineNode *> nodesA;
+        std::vector<const LineNode *> nodesB;
+        for (const LineNode *node = a.source->lines; node; node = node->next) {
+            nodesA.push_back(node);
+            a.total += node->lineCount();
+        }
+        for (const LineNode *node = b.source->lines; node; node = node->next) {
+            nodesB.push_back(node);
+            b.total += node->lineCount();
+        }
+        size_t shared = std::min(nodesA.size(), nodesB.size());
+        size_t first = 0;
+        while (first < shared && sameNode(nodesA[first], nodesB[first])) {
+            a.prefix += nodesA[first]->lineCount();
+            ++first;
+        }
+        b.prefix = a.prefix;
+        for (size_t last = 1; last <= shared - first &&
+                              sameNode(nodesA[nodesA.size() - last], nodesB[nodesB.size() - last]); ++last) {
+            suffix += nodesA[nodesA.size() - last]->lineCount();
+        }
+    }
+
+    static void hashMiddle(Side &side, size_t suffix) {
+        auto visit = [&side](const char *line, size_t length) {
+            side.hashes.push_back(hashLine(line, length));
+            return true;
+        };
+        if (side.source->kind == Source::EMPTY) {
+            return;
+        }
+        if (side.source->kind == Source::TEXT_FILE) {
+            forEachFileLine(side.source->file, visit);
+            side.total = side.hashes.size();
+            return;
+        }
+        size_t count = side.total - side.prefix - suffix;
+        side.hashes.reserve(count);
+        Text::forEachLine(side.source->lines, [&](const char *line, size_t length) {
+            return side.hashes.size() < count && visit(line, length);
+        }, false, static_cast<int>(side.prefix));
+    }
+
+    // Copies the lines of `lines[lo, hi)` that also occur in `other[otherLo, otherHi)` to `kept`, remembering
+    // their indices in `index`, and marks the others in `changed`.
+    static void keepShared(const std::vector<uint64_t> &lines, size_t lo, size_t hi, const std::vector<uint64_t> &other,
+                           size_t otherLo, size_t otherHi, std::vector<bool> &changed, std::vector<uint64_t> &kept,
+                           std::vector<size_t> &index) {
+        std::vector<uint64_t> sorted(other.begin() + otherLo, other.begin() + otherHi);
+        std::sort(sorted.begin(), sorted.end());
+        for (size_t i = lo; i < hi; ++i) {
+            if (std::binary_search(sorted.begin(), sorted.end(), lines[i])) {
+                kept.push_back(lines[i]);
+                index.push_back(i);
+            } else {
+                changed[i] = true;
+            }
+        }
+    }
+
+    // Finds a point (x, y) on a shortest edit path between a[0, n) and b[0, m) with a split into two smaller
+    // problems. Returns false when the only such split is replacing everything.
+    bool bisect(const uint64_t *a, long long n, const uint64_t *b, long long m, long long &splitX,
+                long long &splitY) {
+        long long limit = MIN_COST_LIMIT;
+        while (limit * limit < n + m) {
+            limit *= 2;
+        }
+        long long maxCost = std::min((n + m + 1) / 2, limit);
+        long long offset = maxCost + 1;
+        forward.assign(2 * offset + 1, -1);
+        backward.assign(2 * offset + 1, -1);
+        forward[offset + 1] = 0;
+        backward[offset + 1] = 0;
+        long long delta = n - m;
+        bool odd = delta % 2 != 0;
+        long long forwardStart = 0;
+        long long forwardEnd = 0;
+        long long backwardStart = 0;
+        long long backwardEnd = 0;
+        for (long long d = 0; d < maxCost; ++d) {
+            for (long long k = -d + forwardStart; k <= d - forwardEnd; k += 2) {
+                long long i = offset + k;
+                long long x = (k == -d || (k != d && forward[i - 1] < forward[i + 1])) ? forward[i + 1]
+                                                                                         : forward[i - 1] + 1;
+                long long y = x - k;
+                while (x < n && y < m && a[x] == b[y]) {
+                    ++x;
+                    ++y;
+                }
+                forward[i] = x;
+                if (x > n) {
+                    forwardEnd += 2;
+                } else if (y > m) {
+                    forwardStart += 2;
+                } else if (odd) {
+                    long long j = offset + delta - k;
+                    if (j >= 0 && j < static_cast<long long>(backward.size()) && backward[j] != -1 &&
+                        x >= n - backward[j]) {
+                        splitX = x;
+                        splitY = y;
+                        return true;
+                    }
+                }
+            }
+            for (long long k = -d + backwardStart; k <= d - backwardEnd; k += 2) {
+                long long j = offset + k;
+                long long x = (k == -d || (k != d && backward[j - 1] < backward[j + 1])) ? backward[j + 1]
+                                                                                           : backward[j - 1] + 1;
+                long long y = x - k;
+                while (x < n && y < m && a[n - x - 1] == b[m - y - 1]) {
+                    ++x;
+                    ++y;
+                }
+                backward[j] = x;
+                if (x > n) {
+                    backwardEnd += 2;
+                } else if (y > m) {
+                    backwardStart += 2;
+                } else if (!odd) {
+                    long long i = offset + delta - k;
+                    if (i >= 0 && i < static_cast<long long>(forward.size()) && forward[i] != -1 &&
+                        forward[i] >= n - x) {
+                        splitX = forward[i];
+                        splitY = forward[i] - (i - offset);
+                        return true;
+                    }
+                }
+            }
+        }
+
+        // too expensive: split where the forward search got furthest
+        long long best = 0;
+        for (long long k = -maxCost; k <= maxCost; ++k) {
+            long long x = forward[offset + k];
+            long long y = x - k;
+            if (x >= 0 && x <= n && y >= 0 && y <= m && x + y > best && x + y < n + m) {
+                best = x + y;
+                splitX = x;
+                splitY = y;
+            }
+        }
+        return best > 0;
+    }
+
+    static void collectHunks(const Side &a, const Side &b, const std::vector<bool> &deleted,
+                             const std::vector<bool> &inserted, std::vector<Hunk> &hunks) {
+        size_t i = 0;
+        size_t j = 0;
+        while (i < deleted.size() || j < inserted.size()) {
+            if ((i < deleted.size() && deleted[i]) || (j < inserted.size() && inserted[j])) {
+                Hunk change{a.prefix + i, 0, b.prefix + j, 0};
+                while (i < deleted.size() && deleted[i]) {
+                    ++i;
+                }
+                while (j < inserted.size() && inserted[j]) {
+                    ++j;
+                }
+                change.a1 = a.prefix + i;
+                change.b1 = b.prefix + j;
+                if (!hunks.empty() && change.a0 - hunks.back().a1 <= 2 * CONTEXT_LINES) {
+                    hunks.back().a1 = change.a1;
+                    hunks.back().b1 = change.b1;
+                } else {
+                    hunks.push_back(change);
+                }
+            } else {
+                ++i;
+                ++j;
+            }
+        }
+        for (Hunk &hunk: hunks) {
+            size_t before = std::min<size_t>(CONTEXT_LINES, hunk.a0);
+            size_t after = std::min<size_t>(CONTEXT_LINES, a.total - hunk.a1);
+            hunk.a0 -= before;
+            hunk.b0 -= before;
+            hunk.a1 += after;
+            hunk.b1 += after;
+        }
+    }
+
+    // Reads the lines in `ranges`, which are sorted and do not overlap, into `lines` in order.
+    static void readRanges(const Source &source, const std::vector<std::pair<size_t, size_t>> &ranges,
+                           std::vector<std::string> &lines) {
+        if (source.kind == Source::EMPTY) {
+            return;
+        }
+        size_t range = 0;
+        size_t index = source.kind == Source::LIST ? ranges.front().first : 0;
+        auto visit = [&](const char *line, size_t length) {
+            while (range < ranges.size() && index >= ranges[range].second) {
+                ++range;
+            }
+            if (range == ranges.size()) {
+                return false;
+            }
+            if (index >= ranges[range].first) {
+                lines.emplace_back(line, length);
+            }
+            ++index;
+            return true;
+        };
+        if (source.kind == Source::LIST) {
+            Text::forEachLine(source.lines, visit, false, static_cast<int>(index));
+        } else {
+            rewind(source.file);
+            forEachFileLine(source.file, visit);
+        }
+    }
+
+    static bool isChanged(const std::vector<bool> &changed, size_t prefix, size_t line) {
+        return line >= prefix && line - prefix < changed.size() && changed[line - prefix];
+    }
+
+    static const std::string &lineAt(const std::vector<std::string> &lines, size_t &next) {
+        static const std::string missing;
+        return next < lines.size() ? lines[next++] : missing;
+    }
+
+    static void printRange(std::ostream &out, size_t first, size_t last) {
+        if (last - first == 1) {
+            out << first + 1;
+        } else {
+            out << (last == first ? first : first + 1) << ',' << last - first;
+        }
+    }
+};
+
+// Whole-document line operations: sort, unique (drop a line equal to the one before it) and keep or drop the
+// lines containing a text. The source lines are decoded one block at a time and the result goes straight into a
+// BlockBuilder, so neither side is ever expanded as a whole.
+//
+// Sorting collects lines until MEMORY_LIMIT bytes and sorts them on all hardware threads. If the whole text fits,
+// that is all; otherwise each sorted run is spilled to a temporary file and the runs are combined by a k-way
+// merge, in several passes when there are more than MERGE_FAN_IN of them.
+class LineOperation {
+public:
+    enum Kind { SORT = 1, UNIQUE, KEEP, DROP };
+    enum SortFlags { NUMERIC = 1, REVERSE = 2, DISTINCT = 4 };
+
+    static const size_t MEMORY_LIMIT = 256 * 1024 * 1024;
+    static const size_t MERGE_FAN_IN = 64;
+    static const size_t PARALLEL_SORT_MIN = 1 << 16; // fewer lines are sorted on the calling thread
+
+    Kind kind;
+    int flags;
+    int field; // 1-based blank-separated field used as the sort key, 0 for the whole line
+    std::string pattern;
+
+    // Packs everything but the pattern into the journal record's count.
+    int encode() const {
+        return kind | flags << 4 | field << 8;
+    }
+
+    static LineOperation decode(int count, const std::string &payload) {
+        return {static_cast<Kind>(count & 0xF), (count >> 4) & 0xF, count >> 8, payload};
+    }
+
+    // Writes the lines from `source` on, transformed, to `builder` and counts them in `lineCount`. Returns false if
+    // a block of the source could not be decompressed or a spill file could not be written or read back; the
+    // output is then incomplete and must be thrown away.
+    bool run(const LineNode *source, BlockBuilder &builder, size_t &lineCount) const {
+        lineCount = 0;
+        if (kind == SORT) {
+            return sort(source, builder, lineCount);
+        }
+        std::string previous;
+        bool first = true;
+        return Text::forEachLine(source, [&](const char *line, size_t length) {
+            bool emit;
+            if (kind == UNIQUE) {
+                emit = first || previous.size() != length || memcmp(previous.data(), line, length) != 0;
+                previous.assign(line, length);
+                first = false;
+            } else {
+                emit = contains(line, length) == (kind == KEEP);
+            }
+            if (emit) {
+                builder.addLine(line, length);
+                ++lineCount;
+            }
+            return true;
+        }, false);
+    }
+
+private:
+    // A line in a run buffer with its sort key, as offsets from the start of the buffer.
+    struct Entry {
+        size_t offset;
+        uint32_t length;
+        uint32_t keyStart;
+        uint32_t keyLength;
+        double number;
+    };
+
+    // A sorted run spilled to disk: each line is stored as its 32-bit length followed by its bytes.
+    struct SpillRun {
+        std::string path;
+        FILE *file;
+        std::string line;
+        Entry entry;
+
+        bool next(const LineOperation &operation) {
+            uint32_t length;
+            if (fread(&length, sizeof(length), 1, file) != 1) {
+                return false;
+            }
+            line.resize(length);
+            if (length > 0 && fread(&line[0], 1, length, file) != length) {
+                return false;
+            }
+            entry = operation.makeEntry(line.c_str(), 0, length);
+            return true;
+        }
+    };
+
+    bool contains(const char *line, size_t length) const {
+        if (pattern.empty()) {
+            return true;
+        }
+        for (const char *end = line + length; static_cast<size_t>(end - line) >= pattern.size(); ++line) {
+            line = static_cast<const char *>(memchr(line, pattern[0], end - line - pattern.size() + 1));
+            if (!line) {
+                return false;
+            }
+            if (memcmp(line, pattern.data(), pattern.size()) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // `base + offset` must be NUL-terminated after `length` bytes, which strtod relies on.
+    Entry makeEntry(const char *base, size_t offset, size_t length) const {
+        const char *line = base + offset;
+        Entry entry{offset, static_cast<uint32_t>(length), 0, static_cast<uint32_t>(length), 0};
+        if (field > 0) {
+            size_t pos = 0;
+            for (int i = 1; i <= field; ++i) {
+                while (pos < length && (line[pos] == ' ' || line[pos] == '\t')) {
+                    ++pos;
+                }
+                size_t start = pos;
+                while (pos < length && line[pos] != ' ' && line[pos] != '\t') {
+                    ++pos;
+                }
+                entry.keyStart = start;
+                entry.keyLength = pos - start;
+            }
+        }
+        if (flags & NUMERIC) {
+            entry.number = strtod(line + entry.keyStart, nullptr);
+            if (entry.number != entry.number) { // NaN would break the ordering
+                entry.number = 0;
+            }
+        }
+        return entry;
+    }
+
+    static int compareBytes(const char *a, size_t aLength, const char *b, size_t bLength) {
+        int result = memcmp(a, b, std::min(aLength, bLength));
+        if (result != 0) {
+            return result;
+        }
+        return (aLength > bLength) - (aLength < bLength);
+    }
+
+    // Orders by key, then by the whole line, so only identical lines compare equal and the output is the same
+    // however the input was split into runs.
+    int compare(const char *aBase, const Entry &a, const char *bBase, const Entry &b) const {
+        int result = 0;
+        if (flags & NUMERIC) {
+            result = (a.number > b.number) - (a.number < b.number);
+        } else if (field > 0) {
+            result = compareBytes(aBase + a.offset + a.keyStart, a.keyLength, bBase + b.offset + b.keyStart,
+                                  b.keyLength);
+        }
+        if (result == 0) {
+            result = compareBytes(aBase + a.offset, a.length, bBase + b.offset, b.length);
+        }
+        return (flags & REVERSE) ? -result : result;
+    }
+
+    void sortEntries(std::vector<Entry> &entries, const char *buffer) const {
+        auto less = [this, buffer](const Entry &a, const Entry &b) {
+            return compare(buffer, a, buffer, b) < 0;
+        };
+        size_t parts = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()),
+                                        entries.size() / PARALLEL_SORT_MIN + 1);
+        if (parts == 1) {
+            std::sort(entries.begin(), entries.end(), less);
+            return;
+        }
+        std::vector<std::vector<Entry>::iterator> bounds;
+        for (size_t i = 0; i <= parts; ++i) {
+            bounds.push_back(entries.begin() + entries.size() * i / parts);
+        }
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < parts; ++i) {
+            workers.emplace_back([&bounds, &less, i] {
+                std::sort(bounds[i], bounds[i + 1], less);
+            });
+        }
+        for (std::thread &worker: workers) {
+            worker.join();
+        }
+        for (size_t width = 1; width < parts; width *= 2) {
+            workers.clear();
+            for (size_t i = 0; i + width < parts; i += 2 * width) {
+                auto first = bounds[i];
+                auto middle = bounds[i + width];
+                auto last = bounds[std::min(i + 2 * width, parts)];
+                workers.emplace_back([first, middle, last, &less] {
+                    std::inplace_merge(first, middle, last, less);
+                });
+            }
+            for (std::thread &worker: workers) {
+                worker.join();
+            }
+        }
+    }
+
+    // Emits a line unless DISTINCT is set and it equals the last one emitted.
+    struct Output {
+        BlockBuilder &builder;
+        size_t &lineCount;
+        bool distinct;
+        std::string last;
+        bool empty;
+
+        void add(const char *line, size_t length) {
+            if (distinct) {
+                if (!empty && last.size() == length && memcmp(last.data(), line, length) == 0) {
+                    return;
+                }
+                last.assign(line, length);
+                empty = false;
+            }
+            builder.addLine(line, length);
+            ++lineCount;
+        }
+    };
+
+    bool sort(const LineNode *source, BlockBuilder &builder, size_t &lineCount) const {
+        std::vector<char> buffer;
+        std::vector<Entry> entries;
+        std::vector<std::string> runs;
+        bool ok = true;
+        ok = Text::forEachLine(source, [&](const char *line, size_t length) { // also false if a spill failed
+            buffer.insert(buffer.end(), line, line + length);
+            buffer.push_back('\0');
+            entries.push_back({buffer.size() - length - 1, static_cast<uint32_t>(length), 0, 0, 0});
+            if (buffer.size() + entries.size() * sizeof(Entry) >= MEMORY_LIMIT) {
+                ok = spill(buffer, entries, runs);
+            }
+            return ok;
+        }, false);
+
+        Output output{builder, lineCount, (flags & DISTINCT) != 0, std::string(), true};
+        if (ok && runs.empty()) {
+            prepare(buffer, entries);
+            for (const Entry &entry: entries) {
+                output.add(buffer.data() + entry.offset, entry.length);
+            }
+            return true;
+        }
+        if (ok && !entries.empty()) {
+            ok = spill(buffer, entries, runs);
+        }
+        std::vector<char>().swap(buffer);
+        std::vector<Entry>().swap(entries);
+
+        while (ok && runs.size() > MERGE_FAN_IN) {
+            std::string merged = spillPath();
+            FILE *out = fopen(merged.c_str(), "wb");
+            ok = out != nullptr;
+            if (ok) {
+                std::vector<std::string> group(runs.begin(), runs.begin() + MERGE_FAN_IN);
+                ok = merge(group, [out](const char *line, size_t length) {
+                    uint32_t size = length;
+                    return fwrite(&size, sizeof(size), 1, out) == 1 && fwrite(line, 1, length, out) == length;
+                });
+                ok = fclose(out) == 0 && ok;
+                runs.erase(runs.begin(), runs.begin() + MERGE_FAN_IN);
+            }
+            runs.push_back(merged); // removed below if the merge failed
+        }
+        if (ok) {
+            ok = merge(runs, [&output](const char *line, size_t length) {
+                output.add(line, length);
+                return true;
+            });
+        }
+        std::error_code error;
+        for (const std::string &run: runs) {
+            std::filesystem::remove(run, error);
+        }
+        return ok;
+    }
+
+    // Sorts the lines collected so far in `buffer`.
+    void prepare(const std::vector<char> &buffer, std::vector<Entry> &entries) const {
+        for (Entry &entry: entries) {
+            entry = makeEntry(buffer.data(), entry.offset, entry.length);
+        }
+        sortEntries(entries, buffer.data());
+    }
+
+    std::string spillPath() const {
+        static std::atomic<unsigned> counter{0};
+        std::error_code error;
+        std::filesystem::path directory = std::filesystem::temp_directory_path(error);
+        std::string name = "simple-text-editor-" + std::to_string(GetCurrentProcessId()) + "-" +
+                           std::to_string(counter++) + ".sort";
+        return error ? name : (directory / name).string();
+    }
+
+    // Sorts the collected lines into a new run file and empties the buffer.
+    bool spill(std::vector<char> &buffer, std::vector<Entry> &entries, std::vector<std::string> &runs) const {
+        prepare(buffer, entries);
+        long long start = Instrumentation::enabled ? Instrumentation::now() : 0;
+        std::string path = spillPath();
+        FILE *out = fopen(path.c_str(), "wb");
+        if (!out) {
+            return false;
+        }
+        runs.push_back(path);
+        bool ok = true;
+        for (const Entry &entry: entries) {
+            ok = ok && fwrite(&entry.length, sizeof(entry.length), 1, out) == 1 &&
+                 fwrite(buffer.data() + entry.offset, 1, entry.length, out) == entry.length;
+        }
+        ok = fclose(out) == 0 && ok;
+        Instrumentation::recordIo(Instrumentation::IO_SORT_SPILL, buffer.size() - entries.size(),
+                                  Instrumentation::enabled ? Instrumentation::now() - start : 0);
+        buffer.clear();
+        entries.clear();
+        return ok;
+    }
+
+    // Merges the sorted run files into `emit` in order.
+    template<typename Emit>
+    bool merge(const std::vector<std::string> &paths, Emit emit) const {
+        std::vector<SpillRun> readers(paths.size());
+        std::vector<size_t> heap;
+        bool ok = true;
+        for (size_t i = 0; i < paths.size(); ++i) {
+            readers[i].path = paths[i];
+            readers[i].file = fopen(paths[i].c_str(), "rb");
+            if (!readers[i].file) {
+                ok = false;
+            } else if (readers[i].next(*this)) {
+                heap.push_back(i);
+            }
+        }
+        // a min-heap on the current lines; the run index breaks ties so the merge is stable
+        auto greater = [this, &readers](size_t a, size_t b) {
+            int result = compare(readers[a].line.c_str(), readers[a].entry, readers[b].line.c_str(), readers[b].entry);
+            return result != 0 ? result > 0 : a > b;
+        };
+        std::make_heap(heap.begin(), heap.end(), greater);
+        while (ok && !heap.empty()) {
+            std::pop_heap(heap.begin(), heap.end(), greater);
+            SpillRun &run = readers[heap.back()];
+            ok = emit(run.line.c_str(), run.line.size());
+            if (run.next(*this)) {
+                std::push_heap(heap.begin(), heap.end(), greater);
+            } else {
+                ok = ok && feof(run.file);
+                heap.pop_back();
+            }
+        }
+        std::error_code error;
+        for (SpillRun &run: readers) {
+            if (run.file) {
+                fclose(run.file);
+            }
+            std::filesystem::remove(run.path, error);
+        }
+        return ok;
+    }
+};
+
+// Native session format. Everything is stored as compressed blocks so that loading only maps the
+// file and wraps each block, without decoding any text:
+//
+//   Header | block data ... | file names | BlockRecord[blockCount] | ListRecord[listCount] |
+//   RefRecord[refCount] | FileRecord[fileCount]
+//
+// A list is a line sequence plus its cursor and word count: list 0 is the document, the following ones are undo
+// entries from oldest to newest. Its line and byte counts follow from its blocks, so loading knows all of its
+// TextStats without decoding them. Blocks shared between lists are written once. Each RefRecord also
+// carries the line and byte offset at which its block starts, which forms the line-offset index;
+// loading hands it to Text, so that going to a line does not walk every block before it.
+// A block may also live in another session file, named in the FileRecord table; undo history
+// spilled to disk uses this to store each block once across all of its files.
+class SessionFile {
+public:
+    struct List {
+        LineNode *head;
+        Cursor cursor;
+        TextStats stats;
+        std::vector<Text::IndexEntry> index = {}; // filled by load
+    };
+
+    // Blocks loaded from one of `sharedFiles` are referred to instead of copied, so those files must not change
+    // while this one is in use. `copied`, if given, receives the data offset of every cold block written here.
+    static bool save(const char *path, const std::vector<List> &lists,
+                     const std::vector<std::string> &sharedFiles = {},
+                     std::unordered_map<const ColdBlock *, uint64_t> *copied = nullptr) {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            return false;
+        }
+        Header header = {};
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+        std::vector<BlockRecord> blocks;
+        std::vector<ListRecord> listRecords;
+        std::vector<RefRecord> refs;
+        std::unordered_map<const ColdBlock *, uint64_t> writtenBlocks;
+        std::vector<char> scratch;
+        uint64_t offset = sizeof(header);
+
+        std::vector<std::filesystem::path> sharedPaths;
+        for (const std::string &file: sharedFiles) {
+            std::error_code error;
+            sharedPaths.push_back(std::filesystem::absolute(file, error));
+        }
+        std::vector<std::string> fileNames;
+        std::unordered_map<const MappedFile *, uint64_t> fileIndices; // 0 for files that are not shared
+        auto fileOf = [&](const ColdBlock *block) -> uint64_t {
+            const MappedFile *mapping = block->getMapping();
+            if (!mapping) {
+                return 0;
+            }
+            auto known = fileIndices.find(mapping);
+            if (known != fileIndices.end()) {
+                return known->second;
+            }
+            auto shared = std::find(sharedPaths.begin(), sharedPaths.end(), mapping->getPath());
+            uint64_t index = 0;
+            if (shared != sharedPaths.end()) {
+                fileNames.push_back(sharedFiles[shared - sharedPaths.begin()]);
+                index = fileNames.size();
+            }
+            fileIndices[mapping] = index;
+            return index;
+        };
+
+        auto writeBlock = [&](const char *compressed, size_t compressedSize, size_t rawSize, int lineCount) {
+            out.write(compressed, compressedSize);
+            blocks.push_back({offset, compressedSize, rawSize, static_cast<uint64_t>(lineCount), 0});
+            offset += compressedSize;
+            return blocks.size() - 1;
+        };
+
+        for (const List &list: lists) {
+            uint64_t words = list.stats.valid ? static_cast<uint64_t>(list.stats.words) : UNKNOWN_WORDS;
+            ListRecord record = {refs.size(), 0, 0, words, list.cursor.getLine(), list.cursor.getChar()};
+            uint64_t firstByte = 0;
+            std::string raw;
+            int rawLines = 0;
+
+            auto flushHotLines = [&]() {
+                if (rawLines == 0) {
+                    return;
+                }
+                scratch.resize(LzCodec::maxCompressedSize(raw.size()));
+                size_t compressedSize = LzCodec::compress(raw.data(), raw.size(), scratch.data());
+                refs.push_back({writeBlock(scratch.data(), compressedSize, raw.size(), rawLines),
+                                record.lineCount, firstByte});
+                record.lineCount += rawLines;
+                firstByte += raw.size();
+                raw.clear();
+                rawLines = 0;
+            };
+
+            for (const LineNode *node = list.head; node; node = node->next) {
+                if (!node->cold) {
+                    raw.append(node->text).push_back('\0');
+                    if (++rawLines == ColdBlock::MAX_LINES || raw.size() >= ColdBlock::MAX_RAW_SIZE) {
+                        flushHotLines();
+                    }
+                    continue;
+                }
+                flushHotLines();
+                auto written = writtenBlocks.find(node->cold);
+                uint64_t blockIndex;
+                if (written != writtenBlocks.end()) {
+                    blockIndex = written->second;
+                } else if (uint64_t file = fileOf(node->cold)) {
+                    blocks.push_back({static_cast<uint64_t>(node->cold->data - node->cold->getMapping()->data),
+                                      node->cold->compressedSize, node->cold->rawSize,
+                                      static_cast<uint64_t>(node->cold->lineCount), file});
+                    blockIndex = blocks.size() - 1;
+                    writtenBlocks[node->cold] = blockIndex;
+                } else {
+                    blockIndex = writeBlock(node->cold->data, node->cold->compressedSize, node->cold->rawSize,
+                                            node->cold->lineCount);
+                    writtenBlocks[node->cold] = blockIndex;
+                    if (copied) {
+                        (*copied)[node->cold] = blocks[blockIndex].dataOffset;
+                    }
+                }
+                refs.push_back({blockIndex, record.lineCount, firstByte});
+                record.lineCount += node->cold->lineCount;
+                firstByte += node->cold->rawSize;
+            }
+            flushHotLines();
+            record.refCount = refs.size() - record.firstRef;
+            listRecords.push_back(record);
+        }
+
+        std::vector<FileRecord> files;
+        for (const std::string &name: fileNames) {
+            out.write(name.data(), name.size());
+            files.push_back({offset, name.size()});
+            offset += name.size();
+        }
+        while (offset % 8 != 0) { // keep the tables aligned so they can be read in place
+            out.put('\0');
+            ++offset;
+        }
+        memcpy(header.magic, MAGIC, sizeof(header.magic));
+        header.version = VERSION;
+        header.listCount = listRecords.size();
+        header.blockCount = blocks.size();
+        header.refCount = refs.size();
+        header.fileCount = files.size();
+        header.blockTableOffset = offset;
+        header.listTableOffset = header.blockTableOffset + blocks.size() * sizeof(BlockRecord);
+        header.refTableOffset = header.listTableOffset + listRecords.size() * sizeof(ListRecord);
+        header.fileTableOffset = header.refTableOffset + refs.size() * sizeof(RefRecord);
+        out.write(reinterpret_cast<const char *>(blocks.data()), blocks.size() * sizeof(BlockRecord));
+        out.write(reinterpret_cast<const char *>(listRecords.data()), listRecords.size() * sizeof(ListRecord));
+        out.write(reinterpret_cast<const char *>(refs.data()), refs.size() * sizeof(RefRecord));
+        out.write(reinterpret_cast<const char *>(files.data()), files.size() * sizeof(FileRecord));
+        out.seekp(0);
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out.close();
+        return out.good();
+    }
+
+    // Fills `lists` with one node chain per stored list. Returns false, leaving `lists` empty,
+    // if the file or a file it refers to cannot be mapped or is not a valid session.
+    static bool load(const char *path, std::vector<List> &lists) {
+        MappedFile *file = MappedFile::open(path);
+        if (!file) {
+            return false;
+        }
+        const Header *header = reinterpret_cast<const Header *>(file->data);
+        std::vector<MappedFile *> files; // the file itself, then the files in its table
+        if (!validate(file, header) || !mapFileTable(file, header, files)) {
+            for (MappedFile *opened: files) {
+                opened->release();
+            }
+            file->release();
+            return false;
+        }
+        const BlockRecord *blockTable = reinterpret_cast<const BlockRecord *>(file->data + header->blockTableOffset);
+        const ListRecord *listTable = reinterpret_cast<const ListRecord *>(file->data + header->listTableOffset);
+        const RefRecord *refTable = reinterpret_cast<const RefRecord *>(file->data + header->refTableOffset);
+
+        std::vector<ColdBlock *> blocks(header->blockCount, nullptr);
+        for (uint64_t i = 0; i < header->blockCount; ++i) {
+            const BlockRecord &record = blockTable[i];
+            MappedFile *source = files[record.file];
+            blocks[i] = source->blockAt(source->data + record.dataOffset, record.compressedSize, record.rawSize,
+                                        static_cast<int>(record.lineCount));
+        }
+        for (uint64_t i = 0; i < header->listCount; ++i) {
+            const ListRecord &record = listTable[i];
+            List list = {nullptr, Cursor(record.cursorLine, record.cursorChar), TextStats::unknown()};
+            if (record.wordCount != UNKNOWN_WORDS) {
+                list.stats = TextStats();
+                list.stats.words = static_cast<long long>(record.wordCount);
+            }
+            list.stats.lines = static_cast<long long>(record.lineCount);
+            list.index.reserve(record.refCount);
+            LineNode *last = nullptr;
+            for (uint64_t ref = record.firstRef; ref < record.firstRef + record.refCount; ++ref) {
+                ColdBlock *block = blocks[refTable[ref].block];
+                block->retain();
+                LineNode *node = new LineNode(block);
+                (last ? last->next : list.head) = node;
+                last = node;
+                list.index.push_back({static_cast<int>(refTable[ref].firstLine), node});
+                list.stats.bytes = static_cast<long long>(refTable[ref].firstByte + block->rawSize);
+            }
+            lists.push_back(list);
+        }
+        for (ColdBlock *block: blocks) {
+            block->release(); // blocks no list refers to go away here
+        }
+        for (MappedFile *opened: files) {
+            opened->release(); // the file itself is released once more below
+        }
+        file->release();
+        return true;
+    }
+
+private:
+    static constexpr char MAGIC[8] = {'S', 'T', 'E', 'D', 'S', 'E', 'S', 'S'};
+    static const uint32_t VERSION = 3;
+    static const uint64_t MAX_FILE_NAME = 4096;
+    static const uint64_t UNKNOWN_WORDS = UINT64_MAX;
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t listCount;
+        uint64_t blockCount;
+        uint64_t refCount;
+        uint64_t blockTableOffset;
+        uint64_t listTableOffset;
+        uint64_t refTableOffset;
+        uint64_t fileCount;
+        uint64_t fileTableOffset;
+    };
+
+    struct BlockRecord {
+        uint64_t dataOffset;
+        uint64_t compressedSize;
+        uint64_t rawSize;
+        uint64_t lineCount;
+        uint64_t file; // 0 for this file, otherwise the number of the FileRecord naming the file holding the data
+    };
+
+    struct ListRecord {
+        uint64_t firstRef;
+        uint64_t refCount;
+        uint64_t lineCount;
+        uint64_t wordCount; // UNKNOWN_WORDS if the words were not counted
+        int32_t cursorLine;
+        int32_t cursorChar;
+    };
+
+    struct RefRecord {
+        uint64_t block;
+        uint64_t firstLine;
+        uint64_t firstByte;
+    };
+
+    struct FileRecord {
+        uint64_t nameOffset;
+        uint64_t nameLength;
+    };
+
+    static bool fits(const MappedFile *file, uint64_t offset, uint64_t count, size_t size) {
+        return offset <= file->size && count <= (file->size - offset) / size;
+    }
+
+    // Bounds-checks every table entry once, so that the rest of the editor can trust the mapped bytes.
+    static bool validate(const MappedFile *file, const Header *header) {
+        if (file->size < sizeof(Header) || memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0 ||
+            header->version != VERSION || header->listCount == 0 ||
+            header->blockTableOffset % 8 != 0 || header->listTableOffset % 8 != 0 || header->refTableOffset % 8 != 0 ||
+            !fits(file, header->blockTableOffset, header->blockCount, sizeof(BlockRecord)) ||
+            !fits(file, header->listTableOffset, header->listCount, sizeof(ListRecord)) ||
+            !fits(file, header->refTableOffset, header->refCount, sizeof(RefRecord)) ||
+            header->fileTableOffset % 8 != 0 ||
+            !fits(file, header->fileTableOffset, header->fileCount, sizeof(FileRecord))) {
+            return false;
+        }
+        const FileRecord *fileTable = reinterpret_cast<const FileRecord *>(file->data + header->fileTableOffset);
+        for (uint64_t i = 0; i < header->fileCount; ++i) {
+            if (fileTable[i].nameLength == 0 || fileTable[i].nameLength > MAX_FILE_NAME ||
+                !fits(file, fileTable[i].nameOffset, fileTable[i].nameLength, 1)) {
+                return false;
+            }
+        }
+        const BlockRecord *blockTable = reinterpret_cast<const BlockRecord *>(file->data + header->blockTableOffset);
+        for (uint64_t i = 0; i < header->blockCount; ++i) {
+            const BlockRecord &record = blockTable[i];
+            if (record.file > header->fileCount ||
+                (record.file == 0 && !fits(file, record.dataOffset, record.compressedSize, 1)) ||
+                record.lineCount == 0 ||
+                record.lineCount > record.rawSize || record.lineCount > INT32_MAX ||
+                record.rawSize / LzCodec::MAX_EXPANSION > record.compressedSize) { // keeps decoding buffers sane
+                return false;
+            }
+        }
+        const ListRecord *listTable = reinterpret_cast<const ListRecord *>(file->data + header->listTableOffset);
+        const RefRecord *refTable = reinterpret_cast<const RefRecord *>(file->data + header->refTableOffset);
+        for (uint64_t i = 0; i < header->listCount; ++i) {
+            const ListRecord &record = listTable[i];
+            if (record.firstRef > header->refCount || record.refCount > header->refCount - record.firstRef) {
+                return false;
+            }
+            uint64_t line = 0;
+            uint64_t byte = 0;
+            for (uint64_t ref = record.firstRef; ref < record.firstRef + record.refCount; ++ref) {
+                if (refTable[ref].block >= header->blockCount || refTable[ref].firstLine != line ||
+                    refTable[ref].firstByte != byte) {
+                    return false;
+                }
+                line += blockTable[refTable[ref].block].lineCount;
+                byte += blockTable[refTable[ref].block].rawSize;
+                if (line > INT32_MAX) {
+                    return false;
+                }
+            }
+            if (record.lineCount != line || (record.wordCount != UNKNOWN_WORDS && record.wordCount > byte)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Maps the files named in the table of a validated session and checks that the blocks stored in them lie
+    // inside them. `files` starts with the session itself, holding a reference of its own, so that the `file` of
+    // a block indexes it directly.
+    static bool mapFileTable(MappedFile *file, const Header *header, std::vector<MappedFile *> &files) {
+        file->retain();
+        files.push_back(file);
+        const FileRecord *fileTable = reinterpret_cast<const FileRecord *>(file->data + header->fileTableOffset);
+        for (uint64_t i = 0; i < header->fileCount; ++i) {
+            std::string name(file->data + fileTable[i].nameOffset, fileTable[i].nameLength);
+            MappedFile *other = MappedFile::open(name.c_str());
+            if (!other) {
+                return false;
+            }
+            files.push_back(other);
+        }
+        const BlockRecord *blockTable = reinterpret_cast<const BlockRecord *>(file->data + header->blockTableOffset);
+        for (uint64_t i = 0; i < header->blockCount; ++i) {
+            if (!fits(files[blockTable[i].file], blockTable[i].dataOffset, blockTable[i].compressedSize, 1)) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+
+// Append-only write-ahead log of the edits applied by TextManager. Records are buffered and
+// written in groups by a background flusher (when a batch fills up or GROUP_COMMIT_INTERVAL_MS
+// after the first pending record), so an edit costs a few bytes in memory and never waits for
+// the disk. The first record names the checkpoint session the log starts from; a checkpoint
+// writes a new session and atomically replaces the log by one holding only that record.
+//
+// Each record is: payload size, checksum, operation, cursor line, cursor position, count,
+// payload. Reading stops at the first torn or corrupted record.
+class EditJournal {
+public:
+    // OP_LOAD and OP_LOAD_SESSION are no longer written: loading a file starts a new checkpoint instead, so
+    // recovery never depends on files that may have changed since. OP_COPY is not written either; pastes carry
+    // their text, so the clipboard is not part of the document. OP_HISTORY records only follow OP_BASE.
+    enum Operation : uint32_t {
+        OP_BASE = 1, OP_APPEND, OP_ADD_LINE, OP_INSERT, OP_DELETE, OP_REPLACE, OP_COPY, OP_PASTE, OP_CUT,
+        OP_UNDO, OP_REDO, OP_LOAD, OP_LOAD_SESSION, OP_LINES, OP_HISTORY, OP_FOLLOW
+    };
+
+    struct Record {
+        Operation operation;
+        int line;
+        int charIndex;
+        int count;
+        std::string payload;
+    };
+
+    // A file of undo entries older than those in the checkpoint, kept by the editor that wrote the log.
+    struct HistoryFile {
+        std::string path;
+        int entries;
+    };
+
+    static const int CHECKPOINT_RECORDS = 1000;
+    static const size_t CHECKPOINT_BYTES = 16 * 1024 * 1024; // OP_FOLLOW payloads do not count, see record()
+
+    explicit EditJournal(const char *journalPath)
+            : path(journalPath), handle(INVALID_HANDLE_VALUE), recordsSinceBase(0), bytesSinceBase(0),
+              stopFlusher(false) {}
+
+    ~EditJournal() {
+        close();
+    }
+
+    bool isOpen() const {
+        return handle != INVALID_HANDLE_VALUE;
+    }
+
+    bool exists() const {
+        std::error_code error;
+        return std::filesystem::exists(path, error);
+    }
+
+    const std::string &checkpointPath() const {
+        return checkpoint;
+    }
+
+    // Checkpoints alternate between two names, so the one the log refers to stays intact
+    // until the log itself has been switched over.
+    std::string nextCheckpointPath() const {
+        std::string next = path + ".ckpt-a";
+        if (checkpoint == next) {
+            next.back() = 'b';
+        }
+        return next;
+    }
+
+    bool needsCheckpoint() const {
+        return recordsSinceBase >= CHECKPOINT_RECORDS || bytesSinceBase >= CHECKPOINT_BYTES;
+    }
+
+    // Atomically replaces the log by one that starts from `checkpointFile` ("" for an empty document). The
+    // base record names the process that owns the log, and the `history` files, oldest first, come before the
+    // undo entries in the checkpoint. They are only referenced, so they must not change while the log is in use.
+    bool reset(const std::string &checkpointFile, const std::vector<HistoryFile> &history = {}) {
+        close();
+        std::string temporary = path + ".tmp";
+        std::string base = encode({OP_BASE, 0, 0, static_cast<int>(GetCurrentProcessId()), checkpointFile});
+        for (const HistoryFile &file: history) {
+            base += encode({OP_HISTORY, 0, 0, file.entries, file.path});
+        }
+        HANDLE file = CreateFile(temporary.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL,
+                                 nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        DWORD written = 0;
+        bool ok = WriteFile(file, base.data(), base.size(), &written, nullptr) && written == base.size() &&
+                  FlushFileBuffers(file);
+        CloseHandle(file);
+        std::error_code error;
+        std::filesystem::rename(temporary, path, error);
+        if (!ok || error) {
+            return false;
+        }
+
+        std::string previous = checkpoint;
+        checkpoint = checkpointFile;
+        recordsSinceBase = 0;
+        bytesSinceBase = base.size();
+        if (!previous.empty() && previous != checkpoint) {
+            MappedFile::detachPath(previous.c_str());
+            std::filesystem::remove(previous, error);
+        }
+        return openForAppend(base.size());
+    }
+
+    // Reads the log left by a previous process; `validLength` is where the intact records end.
+    // Recording stays off until resume() is called, so the edits can be replayed first.
+    bool recover(std::vector<Record> &records, size_t &validLength) {
+        std::ifstream in(path, std::ios::binary);
+        if (!in) {
+            return false;
+        }
+        std::string contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        size_t offset = 0;
+        Record record;
+        while (decode(contents, offset, record)) {
+            records.push_back(record);
+        }
+        if (records.empty() || records[0].operation != OP_BASE) {
+            records.clear();
+            return false;
+        }
+        checkpoint = records[0].payload;
+        recordsSinceBase = records.size() - 1;
+        bytesSinceBase = offset;
+        validLength = offset;
+        return true;
+    }
+
+    bool resume(size_t validLength) {
+        return openForAppend(validLength);
+    }
+
+    void record(Operation operation, const Cursor &position, int count, const std::string &payload = std::string()) {
+        if (!isOpen()) {
+            return;
+        }
+        std::string bytes = encode({operation, position.getLine(), position.getChar(), count, payload});
+        ++recordsSinceBase;
+        // A followed file can grow by megabytes a second; counting its bytes would rewrite the whole document every
+        // CHECKPOINT_BYTES of it, so only the record counts and the log grows with the file until the next checkpoint.
+        bytesSinceBase += operation == OP_FOLLOW ? HEADER_SIZE : bytes.size();
+        std::lock_guard<std::mutex> lock(pendingMutex);
+        pending += bytes;
+        ++pendingRecords;
+        if (pendingRecords == 1 || pendingRecords >= GROUP_COMMIT_RECORDS || pending.size() >= GROUP_COMMIT_BYTES) {
+            flusherWakeup.notify_one();
+        }
+    }
+
+    // Writes and syncs everything recorded so far.
+    void commit() {
+        std::lock_guard<std::mutex> writeLock(writeMutex);
+        std::string batch;
+        {
+            std::lock_guard<std::mutex> lock(pendingMutex);
+            batch.swap(pending);
+            pendingRecords = 0;
+        }
+        if (batch.empty() || handle == INVALID_HANDLE_VALUE) {
+            return;
+        }
+        long long start = Instrumentation::enabled ? Instrumentation::now() : 0;
+        DWORD written = 0;
+        if (!WriteFile(handle, batch.data(), batch.size(), &written, nullptr) || written != batch.size() ||
+            !FlushFileBuffers(handle)) {
+            std::cout << "Failed to write the edit journal." << std::endl;
+        }
+        Instrumentation::recordIo(Instrumentation::IO_JOURNAL, batch.size(),
+                                  Instrumentation::enabled ? Instrumentation::now() - start : 0);
+    }
+
+    void close() {
+        if (flusher.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(pendingMutex);
+                stopFlusher = true;
+            }
+            flusherWakeup.notify_one();
+            flusher.join();
+        }
+        commit();
+        if (handle != INVALID_HANDLE_VALUE) {
+            CloseHandle(handle);
+            handle = INVALID_HANDLE_VALUE;
+        }
+    }
+
+    // Used on a clean exit: nothing needs recovering any more.
+    void discard() {
+        close();
+        std::error_code error;
+        std::filesystem::remove(path, error);
+        for (const char *suffix: {".ckpt-a", ".ckpt-b"}) {
+            std::string checkpointFile = path + suffix;
+            MappedFile::detachPath(checkpointFile.c_str());
+            std::filesystem::remove(checkpointFile, error);
+        }
+        checkpoint.clear();
+    }
+
+    // Flushes a file written through the C++ streams to stable storage.
+    static bool syncFile(const char *filePath) {
+        HANDLE file = CreateFile(filePath, GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                 FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        bool ok = FlushFileBuffers(file);
+        CloseHandle(file);
+        return ok;
+    }
+
+private:
+    static const int GROUP_COMMIT_RECORDS = 64;
+    static const size_t GROUP_COMMIT_BYTES = 64 * 1024;
+    static constexpr int GROUP_COMMIT_INTERVAL_MS = 50; // constexpr: bound to a reference by std::chrono
+    static const size_t HEADER_SIZE = 6 * sizeof(uint32_t);
+
+    std::string path;
+    std::string checkpoint;
+    HANDLE handle;
+    int recordsSinceBase;
+    size_t bytesSinceBase;
+
+    std::mutex writeMutex;
+    std::mutex pendingMutex;
+    std::condition_variable flusherWakeup;
+    std::string pending;
+    int pendingRecords = 0;
+    bool stopFlusher;
+    std::thread flusher;
+
+    bool openForAppend(size_t length) {
+        if (isOpen()) { // the flusher is running and the log may already hold newer records
+            return false;
+        }
+        handle = CreateFile(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                            FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (handle == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        LARGE_INTEGER position;
+        position.QuadPart = length;
+        SetFilePointerEx(handle, position, nullptr, FILE_BEGIN);
+        SetEndOfFile(handle); // drops a torn record left by a crash
+        stopFlusher = false;
+        flusher = std::thread(&EditJournal::flushLoop, this);
+        return true;
+    }
+
+    void flushLoop() {
+        std::unique_lock<std::mutex> lock(pendingMutex);
+        while (!stopFlusher) {
+            flusherWakeup.wait(lock, [this] { return stopFlusher || pendingRecords > 0; });
+            if (pendingRecords < GROUP_COMMIT_RECORDS && pending.size() < GROUP_COMMIT_BYTES) {
+                // give the group a moment to fill up before paying for the sync
+                flusherWakeup.wait_for(lock, std::chrono::milliseconds(GROUP_COMMIT_INTERVAL_MS), [this] {
+                    return stopFlusher || pendingRecords >= GROUP_COMMIT_RECORDS ||
+                           pending.size() >= GROUP_COMMIT_BYTES;
+                });
+            }
+            lock.unlock();
+            commit();
+            lock.lock();
+        }
+    }
+
+    static uint32_t checksum(const char *data, size_t size) {
+        uint32_t hash = 2166136261u; // FNV-1a
+        for (size_t i = 0; i < size; ++i) {
+            hash = (hash ^ static_cast<unsigned char>(data[i])) * 16777619u;
+        }
+        return hash;
+    }
+
+    static std::string encode(const Record &record) {
+        uint32_t fields[6] = {static_cast<uint32_t>(record.payload.size()), 0, record.operation,
+                              static_cast<uint32_t>(record.line), static_cast<uint32_t>(record.charIndex),
+                              static_cast<uint32_t>(record.count)};
+        std::string bytes(reinterpret_cast<const char *>(fields), sizeof(fields));
+        bytes += record.payload;
+        fields[1] = checksum(bytes.data() + 2 * sizeof(uint32_t), bytes.size() - 2 * sizeof(uint32_t));
+        memcpy(&bytes[sizeof(uint32_t)], &fields[1], sizeof(uint32_t));
+        return bytes;
+    }
+
+    static bool decode(const std::string &contents, size_t &offset, Record &record) {
+        if (contents.size() - offset < HEADER_SIZE) {
+            return false;
+        }
+        uint32_t fields[6];
+        memcpy(fields, contents.data() + offset, sizeof(fields));
+        if (fields[0] > contents.size() - offset - HEADER_SIZE ||
+            checksum(contents.data() + offset + 2 * sizeof(uint32_t), HEADER_SIZE - 2 * sizeof(uint32_t) + fields[0]) !=
+            fields[1] || fields[2] < OP_BASE || fields[2] > OP_FOLLOW) {
+            return false;
+        }
+        record.operation = static_cast<Operation>(fields[2]);
+        record.line = static_cast<int>(fields[3]);
+        record.charIndex = static_cast<int>(fields[4]);
+        record.count = static_cast<int>(fields[5]);
+        record.payload.assign(contents, offset + HEADER_SIZE, fields[0]);
+        offset += HEADER_SIZE + fields[0];
+        return true;
+    }
+};
+
+
+// An immutable copy of the document at one version. Snapshots are handed out as shared_ptr: the
+// editor keeps the latest one for new readers until the next edit, and every version is freed as
+// soon as the last reader holding it lets go. Cold blocks are shared with the document, so taking
+// a snapshot only copies expanded lines, and readers may scan it on any thread without the lock.
+class DocumentSnapshot {
+public:
+    DocumentSnapshot(LineNode *lines, unsigned long long documentVersion) : head(lines), version(documentVersion) {}
+
+    ~DocumentSnapshot() {
+        while (head) {
+            LineNode *next = head->next;
+            delete head;
+            head = next;
+        }
+    }
+
+    DocumentSnapshot(const DocumentSnapshot &) = delete;
+    DocumentSnapshot &operator=(const DocumentSnapshot &) = delete;
+
+    unsigned long long getVersion() const {
+        return version;
+    }
+
+    // Like Text::forEachLine, decoding cold blocks privately since the caller may be on any thread.
+    template<typename Visitor>
+    bool forEachLine(Visitor visit, int skipLines = 0) const {
+        return Text::forEachLine(head, visit, false, skipLines);
+    }
+
+    // Writes the text to `out` and closes it; returns whether all of it was written.
+    bool write(std::ofstream &out, Instrumentation::IoKind kind) const {
+        long long start = Instrumentation::enabled ? Instrumentation::now() : 0;
+        size_t bytesWritten = 0;
+        forEachLine([&out, &bytesWritten](const char *line, size_t length) {
+            out.write(line, length).put('\n');
+            bytesWritten += length + 1;
+            return true;
+        });
+        out.close();
+        Instrumentation::recordIo(kind, bytesWritten, Instrumentation::enabled ? Instrumentation::now() - start : 0);
+        return out.good();
+    }
+
+private:
+    LineNode *head;
+    unsigned long long version;
+};
+
+
+// Writes the document to a file on a background thread, every `intervalSeconds` while there are
+// unsaved edits and/or as soon as `dirtyThreshold` edits have piled up. The worker pins a snapshot
+// of the document and writes it without holding the document lock, so editing never waits for
+// the disk.
+class AutosaveWorker {
+public:
+    AutosaveWorker() : intervalSeconds(0), dirtyThreshold(0), dirtyEdits(0), stop(false) {}
+
+    ~AutosaveWorker() {
+        disable();
+    }
+
+    bool isEnabled() const {
+        return worker.joinable();
+    }
+
+    // `tryPinSnapshot` returns the current snapshot, or nullptr while the document is busy.
+    void enable(const char *filePath, int interval, int threshold,
+                std::function<std::shared_ptr<const DocumentSnapshot>()> tryPinSnapshot) {
+        disable();
+        path = filePath;
+        intervalSeconds = interval;
+        dirtyThreshold = threshold;
+        pinSnapshot = tryPinSnapshot;
+        dirtyEdits = 0;
+        stop = false;
+        worker = std::thread(&AutosaveWorker::run, this);
+    }
+
+    void disable() {
+        if (!worker.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        wakeup.notify_one();
+        worker.join();
+    }
+
+    void noteEdit() {
+        if (!isEnabled()) {
+            return;
+        }
+        int dirty = dirtyEdits.fetch_add(1) + 1;
+        if (dirtyThreshold > 0 && dirty >= dirtyThreshold) {
+            std::lock_guard<std::mutex> lock(mutex);
+            wakeup.notify_one();
+        }
+    }
+
+private:
+    std::string path;
+    std::function<std::shared_ptr<const DocumentSnapshot>()> pinSnapshot;
+    int intervalSeconds;
+    int dirtyThreshold;
+    std::atomic<int> dirtyEdits;
+    std::atomic<bool> stop;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::thread worker;
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stop) {
+            auto due = [this] { return stop || (dirtyThreshold > 0 && dirtyEdits >= dirtyThreshold); };
+            if (intervalSeconds > 0) {
+                wakeup.wait_for(lock, std::chrono::seconds(intervalSeconds), due);
+            } else {
+                wakeup.wait(lock, due);
+            }
+            if (stop || dirtyEdits == 0) {
+                continue;
+            }
+            lock.unlock();
+            saveSnapshot();
+            lock.lock();
+        }
+    }
+
+    void saveSnapshot() {
+        dirtyEdits = 0; // edits from here on are either in the snapshot or count towards the next save
+        std::shared_ptr<const DocumentSnapshot> snapshot;
+        while (!(snapshot = pinSnapshot())) {
+            if (stop) { // the main thread may be waiting for us while it runs a command
+                return;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+
+        std::string temporary = path + ".tmp";
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        bool written = out && snapshot->write(out, Instrumentation::IO_AUTOSAVE);
+        snapshot.reset();
+
+        std::error_code error;
+        if (written) {
+            std::filesystem::rename(temporary, path, error); // readers never see a half-written autosave
+        }
+        if (!written || error) {
+            std::cout << "Autosave to " << path << " failed." << std::endl;
+        }
+    }
+};
+
+
+// Watches a file that another process keeps appending to, such as a log, and reads only the bytes written
+// since the last read. Changes are noticed through a change notification on the file's directory, and the
+// file is also checked every POLL_INTERVAL_MS, since NTFS may not report the growth of a file that is still
+// open for writing and some file systems send no notifications at all. The file is held open with full
+// sharing, so writers can go on and the log can be rotated (renamed away) meanwhile.
+class LogFollower {
+public:
+    static const int POLL_INTERVAL_MS = 200;
+    static const DWORD READ_CHUNK_SIZE = 1 << 20;
+    static const int CHUNKS_PER_READ = 8; // a read returns after this many chunks even if a writer races ahead
+
+    // What a read found: nothing new, new bytes, or a file that has to be read again from its start
+    // because it was truncated or because the path now names a new file.
+    enum Event { NONE, DATA, RESTARTED };
+
+    LogFollower() : handle(INVALID_HANDLE_VALUE), notification(INVALID_HANDLE_VALUE), offset(0), identity{} {}
+
+    ~LogFollower() {
+        stop();
+    }
+
+    LogFollower(const LogFollower &) = delete;
+    LogFollower &operator=(const LogFollower &) = delete;
+
+    // Starts following `filePath` after its first `startOffset` bytes, which the caller has already read.
+    bool start(const char *filePath, unsigned long long startOffset) {
+        stop();
+        path = filePath;
+        handle = openPath();
+        if (handle == INVALID_HANDLE_VALUE || !fileIdentity(handle, identity)) {
+            stop();
+            return false;
+        }
+        offset = startOffset;
+        LARGE_INTEGER position;
+        position.QuadPart = static_cast<long long>(offset);
+        SetFilePointerEx(handle, position, nullptr, FILE_BEGIN);
+
+        std::error_code error;
+        std::string directory = std::filesystem::absolute(path, error).parent_path().string();
+        notification = FindFirstChangeNotification(directory.c_str(), FALSE, FILE_NOTIFY_CHANGE_FILE_NAME |
+                                                                             FILE_NOTIFY_CHANGE_SIZE |
+                                                                             FILE_NOTIFY_CHANGE_LAST_WRITE);
+        return true; // without a notification the file is polled only
+    }
+
+    void stop() {
+        if (notification != INVALID_HANDLE_VALUE) {
+            FindCloseChangeNotification(notification);
+            notification = INVALID_HANDLE_VALUE;
+        }
+        if (handle != INVALID_HANDLE_VALUE) {
+            CloseHandle(handle);
+            handle = INVALID_HANDLE_VALUE;
+        }
+    }
+
+    // Returns once the directory reports a change or POLL_INTERVAL_MS have passed.
+    void wait() {
+        if (notification == INVALID_HANDLE_VALUE) {
+            Sleep(POLL_INTERVAL_MS);
+        } else if (WaitForSingleObject(notification, POLL_INTERVAL_MS) == WAIT_OBJECT_0) {
+            FindNextChangeNotification(notification);
+        }
+    }
+
+    // Passes new bytes to consume(data, size). A rotated file is read to its end before the new one is opened;
+    // after RESTARTED the following reads start at the beginning of the file.
+    template<typename Consumer>
+    Event read(Consumer consume) {
+        LARGE_INTEGER size;
+        if (GetFileSizeEx(handle, &size) && static_cast<unsigned long long>(size.QuadPart) < offset) {
+            LARGE_INTEGER start;
+            start.QuadPart = 0;
+            SetFilePointerEx(handle, start, nullptr, FILE_BEGIN);
+            offset = 0;
+            return RESTARTED;
+        }
+
+        long long startTime = Instrumentation::enabled ? Instrumentation::now() : 0;
+        buffer.resize(READ_CHUNK_SIZE);
+        size_t total = 0;
+        DWORD bytesRead = 0;
+        for (int chunk = 0; chunk < CHUNKS_PER_READ &&
+                            ReadFile(handle, buffer.data(), READ_CHUNK_SIZE, &bytesRead, nullptr) && bytesRead > 0;
+             ++chunk) {
+            consume(buffer.data(), static_cast<size_t>(bytesRead));
+            offset += bytesRead;
+            total += bytesRead;
+        }
+        if (total > 0) {
+            Instrumentation::recordIo(Instrumentation::IO_LOAD, total,
+                                      Instrumentation::enabled ? Instrumentation::now() - startTime : 0);
+            return DATA;
+        }
+
+        HANDLE current = openPath();
+        FileIdentity currentIdentity;
+        if (current == INVALID_HANDLE_VALUE) {
+            return NONE; // rotated away, the new file is not there yet
+        }
+        if (!fileIdentity(current, currentIdentity) || currentIdentity == identity) {
+            CloseHandle(current);
+            return NONE;
+        }
+        CloseHandle(handle);
+        handle = current;
+        identity = currentIdentity;
+        offset = 0;
+        return RESTARTED;
+    }
+
+private:
+    struct FileIdentity {
+        DWORD volume;
+        DWORD indexHigh;
+        DWORD indexLow;
+
+        bool operator==(const FileIdentity &other) const {
+            return volume == other.volume && indexHigh == other.indexHigh && indexLow == other.indexLow;
+        }
+    };
+
+    std::string path;
+    HANDLE handle;
+    HANDLE notification;
+    unsigned long long offset;
+    FileIdentity identity;
+    std::vector<char> buffer;
+
+    HANDLE openPath() const {
+        return CreateFile(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+                          OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    }
+
+    static bool fileIdentity(HANDLE file, FileIdentity &result) {
+        BY_HANDLE_FILE_INFORMATION information;
+        if (!GetFileInformationByHandle(file, &information)) {
+            return false;
+        }
+        result = {information.dwVolumeSerialNumber, information.nFileIndexHigh, information.nFileIndexLow};
+        return true;
+    }
+};
+
+
+class PathValidator {
+public:
+    static const size_t MAX_PATH_LENGTH = 260;
+
+    bool isValidInputPath(const char* path) {
+        std::ifstream infile(path);
+        return infile.good();
+    }
+
+    bool isValidOutputPath(const char* path) {
+        std::filesystem::path fsPath(path);
+
+        if (fsPath.has_parent_path()) {
+            if (!std::filesystem::exists(fsPath.parent_path())) {
+                return false;
+            }
+        }
+
+        // check if the file can be created or opened
+        std::ofstream outfile(path, std::ios::app);
+        bool canCreate = outfile.good();
+        outfile.close();
+        return canCreate;
+    }
+};
+
+class CaesarCipher {
+public:
+    CaesarCipher(const char* dllPath) {
+        handle = LoadLibrary(TEXT(dllPath));
+        if (!handle || handle == INVALID_HANDLE_VALUE) {
+            throw std::runtime_error("Library was not found");
+        }
+
+        encryption = (encryption_ptr) GetProcAddress(handle, TEXT("encrypt"));
+        if (!encryption) {
+            FreeLibrary(handle);
+            throw std::runtime_error("Function 'encrypt' was not found");
+        }
+
+        decryption = (decryption_ptr) GetProcAddress(handle, TEXT("decrypt"));
+        if (!decryption) {
+            FreeLibrary(handle);
+            throw std::runtime_error ("Function 'decrypt' was not found");
+        }
+    }
+
+    ~CaesarCipher() {
+        if (handle) {
+            FreeLibrary(handle);
+        }
+    }
+
+    void processFile(const char* inputFilePath, const char* outputFilePath, int shift, bool isEncryption) {
+        processFileInternal(inputFilePath, outputFilePath, shift, isEncryption ? encryption : decryption);
+    }
+
+private:
+    HINSTANCE handle;
+    typedef char* (*encryption_ptr)(const char*, int);
+    typedef char* (*decryption_ptr)(const char*, int);
+    encryption_ptr encryption;
+    decryption_ptr decryption;
+
+    static const size_t CHUNK_SIZE = 128;
+
+    void processFileInternal(const char* inputFilePath, const char* outputFilePath, int shift, char* (*process)(const char*, int)) {
+        std::ifstream inputFile(inputFilePath, std::ios::binary);
+        if (!inputFile.is_open()) {
+            std::cout << "Failed to open input file. Please, make sure path exists." << std::endl;
+            return;
+        }
+
+        std::ofstream outputFile(outputFilePath, std::ios::binary);
+        if (!outputFile.is_open()){
+            std::cout << "Failed to open output file. Please, make sure path exists." << std::endl;
+            inputFile.close();
+            return;
+        }
+
+        char buffer[CHUNK_SIZE + 1];
+        long long readStart = Instrumentation::enabled ? Instrumentation::now() : 0;
+        while (inputFile.read(buffer, CHUNK_SIZE) || inputFile.gcount() > 0) {
+            size_t bytesRead = inputFile.gcount();
+            if (Instrumentation::enabled) {
+                Instrumentation::recordIo(Instrumentation::IO_CIPHER_READ, bytesRead, Instrumentation::now() - readStart);
+            }
+            buffer[bytesRead] = '\0';
+            char* processedContent = process(buffer, shift);
+            if (processedContent) {
+                processedContent[bytesRead] = '\0';
+                long long writeStart = Instrumentation::enabled ? Instrumentation::now() : 0;
+                outputFile.write(processedContent, bytesRead);
+                if (Instrumentation::enabled) {
+                    Instrumentation::recordIo(Instrumentation::IO_CIPHER_WRITE, bytesRead, Instrumentation::now() - writeStart);
+                }
+                delete[] processedContent;
+            } else {
+                std::cout << "Processing failed for chunk." << std::endl;
+                break;
+            }
+            readStart = Instrumentation::enabled ? Instrumentation::now() : 0;
+        }
+        inputFile.close();
+        outputFile.close();
+    }
+};
+
+class TextManager {
+public:
+    static const int MAX_FILENAME_LENGTH = 21;
+    static const int COMMAND_COUNT = 25;
+    static const int MAX_SUBSTRING_SYMBOLS = 30;
+    static const int SUBSTRING_BUFFER_SIZE = 4 * MAX_SUBSTRING_SYMBOLS + 1; // room for four-byte UTF-8 characters
+    static const size_t READ_CHUNK_SIZE = 1 << 20;
+    static const size_t DEFAULT_UNDO_WINDOW = 100;
+    static const size_t UNDO_SPILL_BATCH = 32;
+    static const int FOLLOW_PRINT_LINES = 20; // new lines printed at most for each change of a followed file
+    static constexpr const char *COMMAND_NAMES[COMMAND_COUNT + 1] = {
+            "", "append", "add_line", "save", "load", "print", "insert", "search", "delete", "replace",
+            "copy", "paste", "cut", "encrypt", "decrypt", "undo", "redo", "statistics",
+            "save_session", "load_session", "autosave", "utf8_mode", "diff",
+            "lines", "text_stats", "follow"};
+
+    TextManager() : currentLine(nullptr), cursor(0, 0), clipboard(nullptr), journal(journalPath()), replaying(false),
+                    utf8Mode(false), savedInputCodePage(0), savedOutputCodePage(0), followPartial(false),
+                    keepHistory(true), undoWindow(undoWindowSetting()), undoSpillCount(0), documentVersion(0),
+                    inputNanoseconds(0) {}
+
+    ~TextManager() {
+        autosave.disable();
+        if (backgroundSave.joinable()) {
+            backgroundSave.join();
+        }
+        freeClipboard();
+        // segment files cannot be removed while blocks still map them
+        latestSnapshot.reset();
+        clearHistory(undoStack);
+        clearHistory(redoStack);
+        text.clear();
+        clearUndoSegments();
+        removeRetiredSegments();
+        if (utf8Mode) {
+            restoreCodePages();
+        }
+    }
+
+    // Offers to replay the journal of a session that did not exit cleanly, then starts journaling.
+    void startJournal() {
+        std::vector<EditJournal::Record> records;
+        size_t validLength = 0;
+        if (!journal.exists() || !journal.recover(records, validLength) ||
+            (records.size() == 1 && records[0].payload.empty())) {
+            if (!records.empty()) {
+                removeUndoSegmentsOf(records[0].count);
+            }
+            journal.discard();
+            startEmptyJournal();
+            return;
+        }
+
+        char answer[2];
+        getUserInputString("Unsaved edits from a previous session were found. Recover them? (y/n)", answer,
+                           sizeof(answer));
+        if (answer[0] != 'y' && answer[0] != 'Y') {
+            removeUndoSegmentsOf(records[0].count);
+            journal.discard();
+            startEmptyJournal();
+            return;
+        }
+
+        replaying = true;
+        if (!records[0].payload.empty() && !loadSessionFile(records[0].payload.c_str())) {
+            std::cout << "The recovery checkpoint could not be read, edits are replayed on an empty text." << std::endl;
+        }
+        for (size_t i = 1; i < records.size(); ++i) {
+            replay(records[i]);
+        }
+        replaying = false;
+        removeUndoSegmentsOf(records[0].count); // those spilled after the checkpoint; the recovered ones stay
+        journal.resume(validLength);
+        checkpointJournal(); // the log now belongs to this process and its segment files
+        std::cout << "Recovered " << std::count_if(records.begin() + 1, records.end(), [](const EditJournal::Record &record) {
+            return record.operation != EditJournal::OP_HISTORY;
+        }) << " edits." << std::endl;
+        displayCursor();
+    }
+
+    // Called on a clean exit, when there is nothing left to recover.
+    void closeJournal() {
+        journal.discard();
+    }
+
+    void appendText() { // always appends to the end regardless of cursor position
+        std::cout << "Please, enter some text you would like to append: " << std::endl;
+        std::string appended;
+        char input[BUFFER_SIZE];
+        long long start = Instrumentation::enabled ? Instrumentation::now() : 0;
+
+        while (fgets(input, sizeof(input), stdin)) {
+            input[strcspn(input, "\n")] = '\0';
+
+            if (input[0] == '\0') {
+                std::cout << "Invalid input. Please enter a non-empty string: " << std::endl;
+                continue;
+            }
+
+            appended += input;
+            if (strlen(input) < BUFFER_SIZE - 1) {
+                break;
+            }
+        }
+        if (start) {
+            inputNanoseconds += Instrumentation::now() - start;
+        }
+
+        if (!appended.empty() && applyAppend(appended.c_str())) {
+            std::cout << "Text was appended successfully." << std::endl;
+            displayCursor();
+        }
+    }
+
+    void addLine() {
+        applyAddLine();
+        std::cout << "New line is started." << std::endl;
+        displayCursor();
+    }
+
+    void saveToFile() {
+        LineNode *curLine = text.getHead();
+        if (!curLine) {
+            std::cout << "The text is empty yet. Please, enter something first." << std::endl;
+            return;
+        }
+
+        char filename[MAX_FILENAME_LENGTH];
+        getUserInputString("Enter the file name (up to 20 characters):", filename, MAX_FILENAME_LENGTH);
+
+        if (backgroundSave.joinable()) {
+            backgroundSave.join(); // the previous save may still be writing this very file
+        }
+        std::ofstream outFile(filename, std::ios::binary);
+        if (!outFile) {
+            std::cout << "Failed to open file " << filename << ". Please, make sure it exists." << std::endl;
+            return;
+        }
+
+        // the text is written from a snapshot on a background thread, so editing can go on meanwhile
+        std::shared_ptr<const DocumentSnapshot> snapshot = currentSnapshot();
+        std::cout << "Saving to " << filename << " in the background." << std::endl;
+        backgroundSave = std::thread([snapshot, out = std::move(outFile), name = std::string(filename)]() mutable {
+            if (snapshot->write(out, Instrumentation::IO_SAVE)) {
+                std::cout << "Operation on file " << name << " completed successfully." << std::endl;
+            } else {
+                std::cout << "Failed to write file " << name << "." << std::endl;
+            }
+        });
+    }
+
+    void loadFromFile() {
+        char filename[MAX_FILENAME_LENGTH];
+        getUserInputString("Enter the file name (up to 20 characters):", filename, MAX_FILENAME_LENGTH);
+
+        if (loadTextFile(filename)) {
+            displayCursor();
+            std::cout << "Operation on file " << filename << " completed successfully." << std::endl;
+        }
+    }
+
+    // Reports the number of bytes read and whether the file ends in a line without '\n' when asked to.
+    bool loadTextFile(const char *filename, unsigned long long *bytesLoaded = nullptr, bool *partialLine = nullptr) {
+        FILE *inFile = fopen(filename, "rb");
+        if (!inFile) {
+            std::cout << "Failed to open file " << filename << ". Please, make sure it exists." << std::endl;
+            return false;
+        }
+
+        char *buffer = new(std::nothrow) char[READ_CHUNK_SIZE];
+        if (!buffer) {
+            std::cout << "Failed to allocate memory for file buffer." << std::endl;
+            fclose(inFile);
+            return false;
+        }
+
+        text.clear();
+        columns.clear();
+        documentChanged();
+        currentLine = nullptr;
+        clearHistory(redoStack); // a redo would drop the file; checkpoints also store no redo entries
+
+        // lines are stored straight into compressed blocks, they are only expanded once the cursor reaches them
+        long long start = Instrumentation::enabled ? Instrumentation::now() : 0;
+        size_t bytesRead = 0;
+        BlockBuilder builder(text);
+        Utf8Validator validator;
+        size_t chunkSize;
+        char lastByte = '\n';
+        while ((chunkSize = fread(buffer, 1, READ_CHUNK_SIZE, inFile)) > 0) {
+            builder.addBytes(buffer, chunkSize);
+            if (utf8Mode) {
+                validator.feed(buffer, chunkSize);
+            }
+            bytesRead += chunkSize;
+            lastByte = buffer[chunkSize - 1];
+        }
+        builder.finish();
+        textStats = builder.getStats();
+        if (utf8Mode && !validator.finish()) {
+            std::cout << "The file is not valid UTF-8 from byte " << validator.errorOffset()
+                      << " on; invalid bytes count as one character each." << std::endl;
+        }
+        delete[] buffer;
+        Instrumentation::recordIo(Instrumentation::IO_LOAD, bytesRead,
+                                  Instrumentation::enabled ? Instrumentation::now() - start : 0);
+        fclose(inFile);
+        if (bytesLoaded) {
+            *bytesLoaded = bytesRead;
+        }
+        if (partialLine) {
+            *partialLine = lastByte != '\n';
+        }
+        placeCursor(0, 0);
+        if (journal.isOpen()) {
+            checkpointJournal(); // recovery must not read the file again, it may have changed by then
+        }
+        return true;
+    }
+
+    void printText() const {
+        if (!text.getHead()) {
+            std::cout << "The text is empty yet. Please, enter something first." << std::endl;
+            return;
+        }
+
+        int lineIndex = 0;
+        std::cout << "Your current text is:" << std::endl;
+        Text::forEachLine(text.getHead(), [this, &lineIndex](const char *line, size_t length) {
+            if (lineIndex == cursor.getLine()) {
+                std::cout.write(line, cursor.getChar());
+                std::cout << "|"; // set the cursor before char
+                std::cout << (line + cursor.getChar()) << std::endl;
+            } else {
+                std::cout.write(line, length) << '\n';
+            }
+            ++lineIndex;
+            return true;
+        });
+        std::cout.flush();
+    }
+
+    void insertSubstring() {
+        if (!currentLine) {
+            std::cout << "No current line to insert into." << std::endl;
+            return;
+        }
+
+        char substring[SUBSTRING_BUFFER_SIZE];
+        getUserSubstring("Enter the substring to insert (up to 30 symbols):", substring);
+
+        if (applyInsert(substring)) {
+            std::cout << "Substring \"" << substring << "\" was inserted successfully at cursor position." << std::endl;
+            displayCursor();
+        }
+    }
+
+    void searchSubstring() const {
+        if (!text.getHead()) {
+            std::cout << "The text is empty. Please, enter something first." << std::endl;
+            return;
+        }
+
+        char substring[SUBSTRING_BUFFER_SIZE];
+        getUserSubstring("Enter the substring to search for (up to 30 symbols):", substring);
+
+        int lineNumber = 1;
+        bool found = false;
+        Text::forEachLine(text.getHead(), [&](const char *line, size_t) {
+            const char *pos = strstr(line, substring);
+            size_t scanned = 0;
+            size_t column = 0;
+            while (pos) {
+                size_t index = pos - line;
+                if (utf8Mode) { // matches come in order, so each line is decoded once
+                    column += Utf8::advance(line, scanned, index, ColumnIndex::NOT_FOUND);
+                } else {
+                    column = index;
+                }
+                std::cout << "Found substring '" << substring << "' at line " << lineNumber << ", position "
+                          << column + 1 << std::endl;
+                found = true;
+                pos = strstr(pos + 1, substring);
+            }
+            ++lineNumber;
+            return true;
+        });
+        if (!found) {
+            std::cout << "Substring \"" << substring << "\" not found." << std::endl;
+        }
+    }
+
+    void deleteSubstring() {
+        if (!currentLine) {
+            std::cout << "No current line to insert into." << std::endl;
+            return;
+        }
+
+        int numChars = getUserInputInt("Enter the number of symbols to delete: ");
+        if (applyDelete(byteCount(numChars))) {
+            std::cout << "Deleted " << numChars << " characters from cursor position." << std::endl;
+            displayCursor();
+        }
+    }
+
+    void replaceSubstring() {
+        if (!currentLine) {
+            std::cout << "No current line to replace in." << std::endl;
+            return;
+        }
+
+        char substring[SUBSTRING_BUFFER_SIZE];
+        getUserSubstring("Enter the substring to insert (up to 30 symbols):", substring);
+
+        if (applyReplace(substring, byteCount(symbolCount(substring)))) {
+            std::cout << "Substring \"" << substring << "\" was inserted with replacement successfully at cursor position."
+                      << std::endl;
+            displayCursor();
+        }
+    }
+
+    void copyText() {
+        if (!currentLine) {
+            std::cout << "No current line to copy from." << std::endl;
+            return;
+        }
+
+        int numChars = getUserInputInt("Enter the number of symbols to copy: ");
+        if (applyCopy(byteCount(numChars))) {
+            std::cout << "Copied text: " << clipboard << std::endl;
+            displayCursor();
+        }
+    }
+
+    void pasteText() {
+        if (!clipboard) {
+            std::cout << "Clipboard is empty. Copy some text first." << std::endl;
+            return;
+        }
+
+        if (!currentLine) {
+            std::cout << "No current line to paste into." << std::endl;
+            return;
+        }
+
+        if (applyPaste(clipboard)) {
+            std::cout << "Pasted text: " << clipboard << std::endl;
+            displayCursor();
+        }
+    }
+
+    void cutText() {
+        if (!currentLine) {
+            std::cout << "No current line to cut from." << std::endl;
+            return;
+        }
+
+        int numChars = getUserInputInt("Enter the number of symbols to cut: ");
+        if (applyCut(byteCount(numChars))) {
+            std::cout << "Cut text: " << clipboard << std::endl;
+            displayCursor();
+        }
+    }
+
+    void saveSession() {
+        char filename[MAX_FILENAME_LENGTH];
+        getUserInputString("Enter the session file name (up to 20 characters):", filename, MAX_FILENAME_LENGTH);
+        char answer[2];
+        getUserInputString("Include undo history? (y/n)", answer, sizeof(answer));
+
+        std::vector<SessionFile::List> lists = {{text.getHead(), cursor, textStats}};
+        std::vector<LineNode *> mapped;
+        bool historyRead = (answer[0] != 'y' && answer[0] != 'Y') || appendHistory(lists, mapped);
+
+        long long start = Instrumentation::enabled ? Instrumentation::now() : 0;
+        MappedFile::detachPath(filename); // the session being overwritten may still back our own blocks
+        bool saved = historyRead && SessionFile::save(filename, lists);
+        for (LineNode *head: mapped) {
+            freeList(head);
+        }
+        if (!saved) {
+            std::cout << "Failed to write session file " << filename << "." << std::endl;
+            return;
+        }
+        Instrumentation::recordIo(Instrumentation::IO_SESSION_SAVE, std::filesystem::file_size(filename),
+                                  Instrumentation::enabled ? Instrumentation::now() - start : 0);
+        std::cout << "Session saved to " << filename << "." << std::endl;
+    }
+
+    void loadSession() {
+        char filename[MAX_FILENAME_LENGTH];
+        getUserInputString("Enter the session file name (up to 20 characters):", filename, MAX_FILENAME_LENGTH);
+
+        if (loadSessionFile(filename)) {
+            displayCursor();
+            std::cout << "Session " << filename << " loaded with " << undoDepth() << " undo steps." << std::endl;
+        }
+    }
+
+    bool loadSessionFile(const char *filename) {
+        long long start = Instrumentation::enabled ? Instrumentation::now() : 0;
+        std::vector<SessionFile::List> lists;
+        if (!SessionFile::load(filename, lists)) {
+            std::cout << "Failed to open session file " << filename << ". Please, make sure it exists." << std::endl;
+            return false;
+        }
+        std::error_code sizeError;
+        Instrumentation::recordIo(Instrumentation::IO_SESSION_LOAD, std::filesystem::file_size(filename, sizeError),
+                                  Instrumentation::enabled ? Instrumentation::now() - start : 0);
+
+        text.clear();
+        columns.clear();
+        documentChanged();
+        text.setHead(lists[0].head, std::move(lists[0].index));
+        textStats = lists[0].stats;
+        clearHistory(undoStack);
+        clearHistory(redoStack);
+        clearUndoSegments();
+        for (size_t i = 1; i < lists.size(); ++i) {
+            undoStack.push_back({lists[i].head, lists[i].cursor, 0, lists[i].stats});
+        }
+
+        Cursor saved = lists[0].cursor;
+        LineNode *line = text.lineAt(saved.getLine());
+        if (line && saved.getChar() >= 0 && saved.getChar() <= static_cast<int>(strlen(line->text))) {
+            placeCursor(saved.getLine(), saved.getChar());
+        } else {
+            placeCursor(0, 0);
+        }
+        if (journal.isOpen()) {
+            checkpointJournal();
+        }
+        return true;
+    }
+
+    void configureAutosave() {
+        int interval = getUserInputInt("Enter the autosave interval in seconds (0 to save by edit count only): ");
+        int threshold = getUserInputInt("Enter the number of edits that triggers an autosave (0 to save by interval only): ");
+        if (interval == 0 && threshold == 0) {
+            autosave.disable();
+            std::cout << "Autosave is disabled." << std::endl;
+            return;
+        }
+
+        char filename[MAX_FILENAME_LENGTH];
+        getUserInputString("Enter the autosave file name (up to 20 characters):", filename, MAX_FILENAME_LENGTH);
+        autosave.enable(filename, interval, threshold, [this] {
+            return pinSnapshot(false);
+        });
+        std::cout << "Autosave to " << filename << " is enabled." << std::endl;
+    }
+
+    void encryptFile() {
+        processFile(true);
+    }
+
+    void decryptFile() {
+        processFile(false);
+    }
+
+    void undo() {
+        if (!applyUndo()) {
+            std::cout << "No actions to undo." << std::endl;
+            return;
+        }
+        std::cout << "Undo operation completed successfully." << std::endl;
+    }
+
+    void redo() {
+        if (!applyRedo()) {
+            std::cout << "No actions to redo." << std::endl;
+            return;
+        }
+        std::cout << "Redo operation completed successfully." << std::endl;
+    }
+
+    void setCursorPosition() {
+        std::lock_guard<std::shared_mutex> lock(documentMutex);
+        int lineIndex = getUserInputInt("Enter the line index: ") - 1;
+        int charIndex = getUserInputInt("Enter the character index: ") - 1;
+
+        if (lineIndex < 0 || charIndex < 0) {
+            std::cout << "Line and character indices must be greater than 0." << std::endl;
+            return;
+        }
+
+        LineNode *curLine = text.lineAt(lineIndex);
+        if (!curLine) {
+            std::cout << "Line index out of bounds." << std::endl;
+            return;
+        }
+
+        size_t offset = charIndex;
+        if (utf8Mode) {
+            offset = columns.byteOffset(curLine, charIndex);
+        } else if (charIndex > static_cast<int>(strlen(curLine->text))) {
+            offset = ColumnIndex::NOT_FOUND;
+        }
+        if (offset == ColumnIndex::NOT_FOUND) {
+            std::cout << "Character index out of bounds." << std::endl;
+            return;
+        }
+        moveCursor(lineIndex, offset);
+    }
+
+    void toggleUtf8Mode() {
+        utf8Mode = !utf8Mode;
+        columns.clear();
+        if (!utf8Mode) {
+            restoreCodePages();
+            std::cout << "Positions and counts are now in bytes." << std::endl;
+            displayCursor();
+            return;
+        }
+
+        savedInputCodePage = GetConsoleCP();
+        savedOutputCodePage = GetConsoleOutputCP();
+        SetConsoleOutputCP(CP_UTF8);
+        SetConsoleCP(CP_UTF8);
+        int lineNumber = 1;
+        bool valid = Text::forEachLine(text.getHead(), [&lineNumber](const char *line, size_t length) {
+            if (Utf8::validPrefix(line, length) != length) {
+                return false;
+            }
+            ++lineNumber;
+            return true;
+        });
+        if (!valid) {
+            std::cout << "Line " << lineNumber << " is not valid UTF-8; invalid bytes count as one character each."
+                      << std::endl;
+        }
+        if (currentLine) { // a cursor set in byte mode may sit inside a character
+            placeCursor(cursor.getLine(), columns.byteOffset(currentLine, columns.column(currentLine, cursor.getChar())));
+        }
+        std::cout << "Positions and counts are now in UTF-8 characters." << std::endl;
+        displayCursor();
+    }
+
+    void restoreCodePages() {
+        SetConsoleOutputCP(savedOutputCodePage);
+        SetConsoleCP(savedInputCodePage);
+    }
+
+    void showDiff() {
+        char answer[3];
+        getUserInputString("Compare with a file (f) or with the text before earlier edits (u)?", answer,
+                           sizeof(answer));
+        LineDiff::Source from;
+        if (answer[0] == 'u' || answer[0] == 'U') {
+            size_t depth = undoDepth();
+            if (depth == 0) {
+                std::cout << "No actions to compare with." << std::endl;
+                return;
+            }
+            int steps = getUserInputInt("Enter the number of undo steps to go back: ");
+            if (steps < 1 || steps > static_cast<int>(depth)) {
+                std::cout << "Please, enter a number from 1 to " << depth << "." << std::endl;
+                return;
+            }
+            while (static_cast<size_t>(steps) > undoStack.size()) {
+                if (!loadUndoSegment()) {
+                    return;
+                }
+            }
+            from = LineDiff::Source::ofList(undoStack[undoStack.size() - steps].head,
+                                            "(undo step " + std::to_string(steps) + ")");
+        } else {
+            char filename[MAX_FILENAME_LENGTH];
+            getUserInputString("Enter the file name (up to 20 characters):", filename, MAX_FILENAME_LENGTH);
+            FILE *file = fopen(filename, "rb");
+            if (!file) {
+                std::cout << "Failed to open file " << filename << ". Please, make sure it exists." << std::endl;
+                return;
+            }
+            from = LineDiff::Source::ofFile(file, filename);
+        }
+
+        LineDiff::Source to = LineDiff::Source::ofList(text.getHead(), "(current text)");
+        size_t hunks = LineDiff::print(std::cout, from, to);
+        bool readFailed = from.file && ferror(from.file);
+        if (from.file) {
+            fclose(from.file);
+        }
+        if (readFailed) {
+            std::cout << "Failed to read file " << from.label << "." << std::endl;
+        } else if (hunks == 0) {
+            std::cout << "No differences found." << std::endl;
+        }
+    }
+
+    void transformLines() {
+        if (!text.getHead()) {
+            std::cout << "The text is empty yet. Please, enter something first." << std::endl;
+            return;
+        }
+        char answer[3];
+        getUserInputString("Choose the operation: (s)ort, (u)nique, (k)eep or (d)rop lines containing a text:", answer,
+                           sizeof(answer));
+        LineOperation operation{LineOperation::SORT, 0, 0, ""};
+        switch (answer[0]) {
+            case 's': {
+                operation.field = getUserInputInt("Enter the field to sort by (0 for whole lines): ");
+                if (operation.field < 0 || operation.field > 0xFFFF) {
+                    std::cout << "The field must be a number from 0 to 65535." << std::endl;
+                    return;
+                }
+                char options[5];
+                getUserInputString("Sort options: n for numbers, r for reverse, u to drop repeated lines, or - for none:",
+                                   options, sizeof(options));
+                operation.flags = (strchr(options, 'n') ? LineOperation::NUMERIC : 0) |
+                                  (strchr(options, 'r') ? LineOperation::REVERSE : 0) |
+                                  (strchr(options, 'u') ? LineOperation::DISTINCT : 0);
+                break;
+            }
+            case 'u':
+                operation.kind = LineOperation::UNIQUE;
+                break;
+            case 'k':
+            case 'd': {
+                operation.kind = answer[0] == 'k' ? LineOperation::KEEP : LineOperation::DROP;
+                char substring[SUBSTRING_BUFFER_SIZE];
+                getUserSubstring("Enter the text to look for (up to 30 symbols):", substring);
+                operation.pattern = substring;
+                break;
+            }
+            default:
+                std::cout << "Unknown operation." << std::endl;
+                return;
+        }
+
+        if (applyLineOperation(operation)) {
+            std::cout << "The text now has " << text.lineCount() << " lines." << std::endl;
+            displayCursor();
+        }
+    }
+
+    void showTextStats() {
+        if (!textStats.valid) {
+            textStats = TextStats();
+            Text::forEachLine(text.getHead(), [this](const char *line, size_t length) {
+                textStats.addLine(line, length);
+                return true;
+            }, false);
+        }
+        std::cout << "Lines: " << textStats.lines << ", words: " << textStats.words << ", bytes: " << textStats.bytes
+                  << "." << std::endl;
+    }
+
+    // Loads a file and then keeps appending what other programs write to it, like `tail -f`, until Enter is
+    // pressed. Only the new bytes are read each time, so following costs no more than the data that arrives.
+    // The document lock is released while waiting, so autosave and other readers can get in between batches.
+    void followFile(std::unique_lock<std::shared_mutex> &lock) {
+        char filename[MAX_FILENAME_LENGTH];
+        getUserInputString("Enter the file name (up to 20 characters):", filename, MAX_FILENAME_LENGTH);
+
+        unsigned long long bytesLoaded = 0;
+        if (!loadTextFile(filename, &bytesLoaded, &followPartial)) {
+            return;
+        }
+        LogFollower follower;
+        if (!follower.start(filename, bytesLoaded)) {
+            std::cout << "Failed to open file " << filename << " for following." << std::endl;
+            return;
+        }
+        std::cout << "Following " << filename << ". Press Enter to stop." << std::endl;
+
+        std::atomic<bool> stopRequested(false);
+        std::thread waitForEnter([&stopRequested]() {
+            std::string line;
+            std::getline(std::cin, line);
+            stopRequested = true;
+        });
+        bool busy = false;
+        bool startStep = true; // everything followed in this session is undone at once
+        while (!stopRequested) {
+            lock.unlock();
+            if (!busy) {
+                follower.wait();
+            }
+            lock.lock();
+            busy = followUpdate(follower, startStep);
+        }
+        waitForEnter.join();
+        follower.stop();
+
+        std::cout << "Stopped following " << filename << ". The text has " << textStats.lines << " lines."
+                  << std::endl;
+        displayCursor();
+    }
+
+    void printMenu() const {
+        std::cout << "Possible commands:\n"
+                  << "1. Append text to current line.\n"
+                  << "2. Add a new line.\n"
+                  << "3. Save the text to a file.\n"
+                  << "4. Load the text from a file.\n"
+                  << "5. Print the text.\n"
+                  << "6. Insert a substring into the text.\n"
+                  << "7. Search for a substring in the text.\n"
+                  << "8. Delete substring.\n"
+                  << "9. Insert text with replacement at a specified position.\n"
+                  << "10. Copy text.\n"
+                  << "11. Paste text.\n"
+                  << "12. Cut text.\n"
+                  << "13. Encrypt file.\n"
+                  << "14. Decrypt file.\n"
+                  << "15. Undo last action.\n"
+                  << "16. Redo last undone action.\n"
+                  << "17. Show performance statistics.\n"
+                  << "18. Save the editing session.\n"
+                  << "19. Load an editing session.\n"
+                  << "20. Configure autosave.\n"
+                  << "21. Switch between byte and UTF-8 character positions.\n"
+                  << "22. Compare the text with a file or an earlier version.\n"
+                  << "23. Sort, deduplicate or filter lines.\n"
+                  << "24. Count lines, words and bytes.\n"
+                  << "25. Follow a file that keeps growing.\n";
+    }
+
+    void printStatistics() const {
+        if (!Instrumentation::enabled) {
+            Instrumentation::enabled = true;
+            std::cout << "Statistics collection was disabled and is now enabled. "
+                      << "Run this command again later to see the numbers." << std::endl;
+            return;
+        }
+        Instrumentation::print(std::cout, COMMAND_NAMES, COMMAND_COUNT);
+    }
+
+    bool dumpStatistics(const char *path) const {
+        return Instrumentation::dumpToFile(path, COMMAND_NAMES, COMMAND_COUNT);
+    }
+
+    // Without history, edits do not keep undo copies of the text.
+    void setHistoryEnabled(bool enabled) {
+        std::lock_guard<std::shared_mutex> lock(documentMutex);
+        keepHistory = enabled;
+        clearHistory(undoStack);
+        clearHistory(redoStack);
+        clearUndoSegments();
+    }
+
+    // Returns a snapshot of the current version of the document, taking one only if there was an
+    // edit since the last. Without `wait` it returns nullptr rather than wait for a running command.
+    std::shared_ptr<const DocumentSnapshot> pinSnapshot(bool wait = true) const {
+        std::shared_lock<std::shared_mutex> lock(documentMutex, std::defer_lock);
+        if (wait) {
+            lock.lock();
+        } else if (!lock.try_lock()) {
+            return nullptr;
+        }
+        return currentSnapshot();
+    }
+
+    // Non-interactive access for EditorServer, safe to call from any thread. Reads scan a pinned
+    // snapshot without holding the document lock, so they run alongside each other and alongside
+    // edits; edits hold the lock exclusively. Lines and positions count from 0 and are in bytes.
+    bool readLines(int first, int count, std::vector<std::string> &lines) const {
+        if (first < 0 || count < 0) {
+            return false;
+        }
+        if (count == 0) {
+            return true;
+        }
+        pinSnapshot()->forEachLine([&lines, count](const char *line, size_t length) {
+            lines.emplace_back(line, length);
+            return static_cast<int>(lines.size()) < count;
+        }, first);
+        return true;
+    }
+
+    void findAll(const char *substring, std::vector<std::pair<int, int>> &matches) const {
+        int lineIndex = 0;
+        pinSnapshot()->forEachLine([substring, &matches, &lineIndex](const char *line, size_t) {
+            for (const char *pos = strstr(line, substring); pos; pos = strstr(pos + 1, substring)) {
+                matches.emplace_back(lineIndex, static_cast<int>(pos - line));
+            }
+            ++lineIndex;
+            return true;
+        });
+    }
+
+    bool writeDocument(const char *filename) const {
+        std::ofstream outFile(filename, std::ios::binary);
+        return outFile && pinSnapshot()->write(outFile, Instrumentation::IO_SAVE);
+    }
+
+    bool openDocument(const char *filename) {
+        std::lock_guard<std::shared_mutex> lock(documentMutex);
+        return loadTextFile(filename);
+    }
+
+    bool insertAt(int lineIndex, int charIndex, const char *substring) {
+        std::lock_guard<std::shared_mutex> lock(documentMutex);
+        return placeCursorChecked(lineIndex, charIndex) && applyInsert(substring);
+    }
+
+    bool deleteAt(int lineIndex, int charIndex, int numChars) {
+        std::lock_guard<std::shared_mutex> lock(documentMutex);
+        return placeCursorChecked(lineIndex, charIndex) && numChars >= 0 && applyDelete(numChars);
     }
 
-    void appendText() { // always appends to the end regardless of cursor position
-        saveState();
-        if (!currentLine) {
-            text.appendLine("");
-            currentLine = text.getHead();
-        }
+    void publicClearInputBuffer(const char *errorMessage) {
+        clearInputBuffer(errorMessage);
+    }
 
-        std::cout << "Please, enter some text you would like to append: " << std::endl;
-        char input[BUFFER_SIZE];
+    bool publicIsValidCommand(char *line, int &command) {
+        return isValidCommand(line, command);
+    }
 
-        while (fgets(input, sizeof(input), stdin)) {
-            input[strcspn(input, "\n")] = '\0';
+    void publicProcessCommand(int command) {
+        processCommand(command);
+    }
 
-            if (input[0] == '\0') {
-                std::cout << "Invalid input. Please enter a non-empty string: " << std::endl;
-                continue;
-            }
+private:
+    // The count of an OP_FOLLOW record.
+    enum FollowFlags { FOLLOW_CONTINUES_LINE = 1, FOLLOW_STARTS_STEP = 2 };
 
-            int inputLen = strlen(input);
-            if (!ensureCapacity(currentLine, inputLen)) {
-                return;
-            }
+    Text text;
+    LineNode *currentLine;
+    struct UndoEntry {
+        LineNode *head;
+        Cursor cursor;
+        size_t bytes; // memory held by the cloned list, only measured while instrumentation is enabled
+        TextStats stats;
+    };
+
+    // Undo entries older than the window, spilled to temporary session files UNDO_SPILL_BATCH at a time. The
+    // segments are ordered oldest first and are all older than the entries in undoStack. The journal's last
+    // checkpoint refers to the segments that existed when it was taken, so a segment that is read back or
+    // dropped is only retired, and its file is removed once the next checkpoint no longer needs it.
+    struct UndoSegment {
+        std::string path;
+        size_t entries; // undo entries stored in the file
+    };
+
+    std::vector<UndoEntry> undoStack; // used as stacks, vectors so that sessions can store the history
+    std::vector<UndoEntry> redoStack;
+    std::vector<UndoSegment> undoSegments;
+    std::vector<std::string> retiredSegments;
+    Cursor cursor;
+    char *clipboard;
+    EditJournal journal;
+    bool replaying; // the old log is being replayed: it is already on disk, so edits are not recorded again
+    bool utf8Mode; // positions and counts typed by the user are in UTF-8 characters instead of bytes
+    UINT savedInputCodePage; // console code pages to restore when UTF-8 mode is turned off
+    UINT savedOutputCodePage;
+    TextStats textStats;
+    bool followPartial; // the followed file ends in a line without '\n', so its next bytes continue the last line
+    bool keepHistory;
+    size_t undoWindow; // undo entries kept in memory, 0 to keep all of them
+    unsigned undoSpillCount;
+    unsigned long long documentVersion; // changes with every edit; written under the exclusive document lock
+    mutable long long inputNanoseconds; // spent by the running command waiting for the user, left out of its latency
+    mutable std::mutex snapshotMutex;
+    mutable std::shared_ptr<const DocumentSnapshot> latestSnapshot; // for readers of the current version
+    std::thread backgroundSave;
+    ColumnIndex columns;
+    mutable std::shared_mutex documentMutex; // held exclusively while a command or edit runs, shared by readers
+    AutosaveWorker autosave; // declared last so that it stops before the document and its lock go away
+
+    static const char *journalPath() {
+        const char *path = std::getenv("EDITOR_JOURNAL");
+        return path ? path : "editor.journal";
+    }
 
-            strcat(currentLine->text, input);
+    static size_t undoWindowSetting() {
+        const char *window = std::getenv("EDITOR_UNDO_WINDOW");
+        return window ? strtoul(window, nullptr, 10) : DEFAULT_UNDO_WINDOW;
+    }
 
-            if (inputLen < BUFFER_SIZE - 1) {
-                std::cout << "Text was appended successfully." << std::endl;
-                moveCursor(cursor.getLine(), strlen(currentLine->text));
-                break;
-            }
+    // Every successful edit goes through here after it has been applied.
+    void logEdit(EditJournal::Operation operation, const Cursor &position, int count,
+                 const std::string &payload = std::string()) {
+        documentChanged();
+        if (!replaying) {
+            journal.record(operation, position, count, payload);
+        }
+        if (currentLine) { // every edit changes the current line from the cursor on, at most
+            columns.invalidate(currentLine, position.getChar());
+        }
+        autosave.noteEdit();
+        if (!replaying && journal.needsCheckpoint() && redoStack.empty()) { // checkpoints only carry the undo history
+            checkpointJournal();
         }
     }
 
-    void addLine() {
-        saveState();
+    // Reads one batch of what was written to the followed file since the last call, appends it and prints the new
+    // lines. The first bytes appended while `startStep` is set begin a new undo step, which clears it. Returns
+    // whether there was anything to read, in which case more may be waiting.
+    bool followUpdate(LogFollower &follower, bool &startStep) {
+        long long linesBefore = textStats.lines;
+        bool continueLast = followPartial;
+        LineNode *last = continueLast ? text.lastLine() : text.getTail(); // new lines go after `last`
+        LogFollower::Event event = follower.read([this, &startStep](const char *data, size_t size) {
+            applyFollow(data, size, followPartial, startStep);
+            startStep = false;
+        });
+        if (event == LogFollower::RESTARTED) {
+            followPartial = false; // a line cut short by the truncation ends here
+            std::cout << "The file was truncated or replaced; reading it again from the start." << std::endl;
+            return true;
+        }
+        if (event == LogFollower::NONE) {
+            return false;
+        }
 
-        LineNode *newLine = new LineNode();
-        if (!currentLine) {
-            text.appendLine("");
-            currentLine = text.getHead();
-        } else {
-            newLine->next = currentLine->next;
-            currentLine->next = newLine;
-            currentLine = newLine;
+        const LineNode *first = last ? last->next : text.getHead();
+        long long newLines = textStats.lines - linesBefore;
+        if (continueLast && last) {
+            first = last;
+            ++newLines;
         }
-        std::cout << "New line is started." << std::endl;
-        moveCursor(cursor.getLine() + 1, 0);
+        long long skipped = std::max(0LL, newLines - FOLLOW_PRINT_LINES);
+        if (skipped > 0) {
+            std::cout << "... " << skipped << " more lines" << std::endl;
+        }
+        Text::forEachLine(first, [](const char *line, size_t length) {
+            std::cout.write(line, length) << '\n';
+            return true;
+        }, true, static_cast<int>(skipped));
+        std::cout.flush();
+        return true;
     }
 
-    void saveToFile() {
-        LineNode *curLine = text.getHead();
-        if (!curLine) {
-            std::cout << "The text is empty yet. Please, enter something first." << std::endl;
-            return;
+    // Appends `length` bytes to the followed file's last line; `complete` tells whether its '\n' came with them.
+    void continueLine(LineNode *line, const char *data, size_t length, bool complete) {
+        length = strnlen(data, length);
+        size_t lineLength = strlen(line->text);
+        if (length > 0 && ensureCapacity(line, static_cast<int>(length))) {
+            textStats.splice(line->text, lineLength, lineLength, 0, data, length);
+            memcpy(line->text + lineLength, data, length);
+            line->text[lineLength + length] = '\0';
+            columns.invalidate(line, lineLength);
+            lineLength += length;
         }
+        if (complete && lineLength > 0 && line->text[lineLength - 1] == '\r') {
+            textStats.splice(line->text, lineLength, lineLength - 1, 1, "", 0);
+            line->text[lineLength - 1] = '\0';
+            columns.invalidate(line, lineLength - 1);
+        }
+    }
 
-        char filename[MAX_FILENAME_LENGTH];
-        getUserInputString("Enter the file name (up to 20 characters):", filename, MAX_FILENAME_LENGTH);
-
-        std::ofstream outFile(filename);
-        if (!outFile) {
-            std::cout << "Failed to open file " << filename << ". Please, make sure it exists." << std::endl;
-            return;
+    // Called with the document lock held exclusively whenever the text changes.
+    void documentChanged() {
+        ++documentVersion;
+        std::shared_ptr<const DocumentSnapshot> outdated;
+        {
+            std::lock_guard<std::mutex> lock(snapshotMutex);
+            outdated.swap(latestSnapshot);
         }
+        // `outdated` is freed here unless a reader still holds it
+    }
 
-        while (curLine) {
-            outFile << curLine->text << std::endl;
-            curLine = curLine->next;
+    // Called with the document lock held in either mode.
+    std::shared_ptr<const DocumentSnapshot> currentSnapshot() const {
+        std::lock_guard<std::mutex> lock(snapshotMutex);
+        if (!latestSnapshot || latestSnapshot->getVersion() != documentVersion) {
+            latestSnapshot = std::make_shared<const DocumentSnapshot>(cloneList(text.getHead()), documentVersion);
         }
-        outFile.close();
-        std::cout << "Operation on file " << filename << " completed successfully." << std::endl;
+        return latestSnapshot;
     }
 
-    void loadFromFile() {
-        char filename[MAX_FILENAME_LENGTH];
-        getUserInputString("Enter the file name (up to 20 characters):", filename, MAX_FILENAME_LENGTH);
+    void startEmptyJournal() {
+        if (!journal.reset("")) {
+            std::cout << "Failed to start the edit journal; edits will not be recovered after a crash." << std::endl;
+        }
+    }
 
-        FILE *inFile = fopen(filename, "r");
-        if (!inFile) {
-            std::cout << "Failed to open file " << filename << ". Please, make sure it exists." << std::endl;
+    // Spilled undo history is not copied into the checkpoint: the log refers to the segment files instead.
+    void checkpointJournal() {
+        std::string next = journal.nextCheckpointPath();
+        std::vector<SessionFile::List> lists = {{text.getHead(), cursor, textStats}};
+        for (const UndoEntry &entry: undoStack) {
+            lists.push_back({entry.head, entry.cursor, entry.stats});
+        }
+        std::vector<EditJournal::HistoryFile> history;
+        for (const UndoSegment &segment: undoSegments) {
+            history.push_back({segment.path, static_cast<int>(segment.entries)});
+        }
+        MappedFile::detachPath(next.c_str());
+        if (!SessionFile::save(next.c_str(), lists, segmentPaths()) || !EditJournal::syncFile(next.c_str()) ||
+            !journal.reset(next, history)) {
+            std::cout << "Failed to write a journal checkpoint." << std::endl;
             return;
         }
+        removeRetiredSegments();
+    }
 
-        text.clear();
-
-        char buffer[BUFFER_SIZE];
-        currentLine = nullptr;
-        while (fgets(buffer, BUFFER_SIZE, inFile)) {
-            buffer[strcspn(buffer, "\n")] = '\0';
-
-            LineNode *newLine = new LineNode(strlen(buffer) + 1);
-            if (!ensureCapacity(newLine, strlen(buffer))) {
-                delete newLine;
-                fclose(inFile);
+    void replay(const EditJournal::Record &record) {
+        switch (record.operation) {
+            case EditJournal::OP_HISTORY: // comes before any edit, so these are older than the checkpoint's entries
+                undoSegments.push_back({record.payload, static_cast<size_t>(record.count)});
                 return;
-            }
-            strcpy(newLine->text, buffer);
-            text.appendLine(newLine->text);
+            case EditJournal::OP_UNDO:
+                applyUndo();
+                return;
+            case EditJournal::OP_REDO:
+                applyRedo();
+                return;
+            case EditJournal::OP_LINES:
+                applyLineOperation(LineOperation::decode(record.count, record.payload));
+                return;
+            case EditJournal::OP_FOLLOW:
+                applyFollow(record.payload.data(), record.payload.size(), record.count & FOLLOW_CONTINUES_LINE,
+                            record.count & FOLLOW_STARTS_STEP);
+                return;
+            default:
+                break;
+        }
 
-            if (!currentLine) {
-                currentLine = text.getHead();
-            } else {
-                currentLine = currentLine->next;
-            }
+        placeCursor(record.line, record.charIndex);
+        switch (record.operation) {
+            case EditJournal::OP_APPEND:
+                applyAppend(record.payload.c_str());
+                break;
+            case EditJournal::OP_ADD_LINE:
+                applyAddLine();
+                break;
+            case EditJournal::OP_INSERT:
+                applyInsert(record.payload.c_str());
+                break;
+            case EditJournal::OP_DELETE:
+                applyDelete(record.count);
+                break;
+            case EditJournal::OP_REPLACE:
+                applyReplace(record.payload.c_str(), record.count);
+                break;
+            case EditJournal::OP_PASTE:
+                applyPaste(record.payload.c_str());
+                break;
+            case EditJournal::OP_CUT:
+                applyCut(record.count);
+                break;
+            default:
+                break;
         }
-        moveCursor(0, 0);
-        fclose(inFile);
-        std::cout << "Operation on file " << filename << " completed successfully." << std::endl;
     }
 
-    void printText() const {
-        if (!text.getHead()) {
-            std::cout << "The text is empty yet. Please, enter something first." << std::endl;
-            return;
+    // The apply* functions perform an edit at the cursor without any user interaction, record it
+    // in the journal and return whether anything changed. They are shared by the interactive
+    // commands and journal replay.
+    bool applyAppend(const char *input) {
+        Cursor position = cursor;
+        saveState();
+        if (!currentLine) {
+            text.appendLine("");
+            currentLine = text.getHead();
+            textStats.addLine("", 0);
         }
 
-        LineNode *curLine = text.getHead();
-        int lineIndex = 0;
-        std::cout << "Your current text is:" << std::endl;
-        while (curLine) {
-            if (lineIndex == cursor.getLine()) {
-                for (int i = 0; i < cursor.getChar(); ++i)
-                    std::cout << curLine->text[i];
-                std::cout << "|"; // set the cursor before char
-                std::cout << (curLine->text + cursor.getChar()) << std::endl;
-            } else {
-                std::cout << curLine->text << std::endl;
-            }
-            curLine = curLine->next;
-            ++lineIndex;
+        if (!ensureCapacity(currentLine, strlen(input))) {
+            return false;
         }
+        size_t length = strlen(currentLine->text);
+        textStats.splice(currentLine->text, length, length, 0, input, strlen(input));
+        strcat(currentLine->text, input);
+
+        logEdit(EditJournal::OP_APPEND, position, 0, input);
+        placeCursor(cursor.getLine(), strlen(currentLine->text));
+        return true;
     }
 
-    void insertSubstring() {
+    void applyAddLine() {
+        Cursor position = cursor;
         saveState();
 
+        textStats.addLine("", 0);
         if (!currentLine) {
-            std::cout << "No current line to insert into." << std::endl;
+            text.appendLine("");
+            logEdit(EditJournal::OP_ADD_LINE, position, 0);
+            placeCursor(text.lineCount() - 1, 0);
             return;
         }
+        text.insertAfter(currentLine, new LineNode());
+        logEdit(EditJournal::OP_ADD_LINE, position, 0);
+        placeCursor(cursor.getLine() + 1, 0);
+    }
 
-        char substring[31];
-        getUserInputString("Enter the substring to insert (up to 30 symbols):", substring, 31);
-
+    bool applyInsert(const char *substring) {
+        if (!currentLine) {
+            return false;
+        }
         int substringLen = strlen(substring);
         int charIndex = cursor.getChar();
         int curTextLen = strlen(currentLine->text);
 
-
         if (charIndex > curTextLen) {
             std::cout << "Cursor position out of bounds." << std::endl;
-            return;
+            return false;
         }
 
         if (!ensureCapacity(currentLine, substringLen)) {
-            return;
+            return false;
         }
+        Cursor position = cursor;
+        saveState();
 
+        textStats.splice(currentLine->text, curTextLen, charIndex, 0, substring, substringLen);
         memmove(currentLine->text + charIndex + substringLen, currentLine->text + charIndex,
                 curTextLen - charIndex + 1);
         memcpy(currentLine->text + charIndex, substring, substringLen);
 
-        std::cout << "Substring \"" << substring << "\" was inserted successfully at cursor position." << std::endl;
-        moveCursor(cursor.getLine(), charIndex + substringLen);
-    }
-
-    void searchSubstring() const {
-        if (!text.getHead()) {
-            std::cout << "The text is empty. Please, enter something first." << std::endl;
-            return;
-        }
-
-        char substring[31];
-        getUserInputString("Enter the substring to search for (up to 30 symbols):", substring, 31);
-
-        LineNode *curLine = text.getHead();
-        int lineNumber = 1;
-        bool found = false;
-        while (curLine) {
-            char *pos = strstr(curLine->text, substring);
-            while (pos) {
-                int index = pos - curLine->text;
-                std::cout << "Found substring '" << substring << "' at line " << lineNumber << ", position "
-                          << index + 1 << std::endl;
-                found = true;
-                pos = strstr(pos + 1, substring);
-            }
-            curLine = curLine->next;
-            ++lineNumber;
-        }
-        if (!found) {
-            std::cout << "Substring \"" << substring << "\" not found." << std::endl;
-        }
+        logEdit(EditJournal::OP_INSERT, position, 0, substring);
+        placeCursor(cursor.getLine(), charIndex + substringLen);
+        return true;
     }
 
-    void deleteSubstring() {
-        saveState();
-
+    bool applyDelete(int numChars) {
         if (!currentLine) {
-            std::cout << "No current line to insert into." << std::endl;
-            return;
+            return false;
         }
-
-        int numChars = getUserInputInt("Enter the number of symbols to delete: ");
         int charIndex = cursor.getChar();
 
         int curTextLen = strlen(currentLine->text);
-        if (charIndex + numChars > curTextLen) {
+        if (numChars < 0 || numChars > curTextLen - charIndex) { // charIndex + numChars could overflow
             std::cout
                     << "The number of characters to delete exceeds the length of the line."
                     << std::endl;
-            return;
+            return false;
         }
+        Cursor position = cursor;
+        saveState();
 
+        textStats.splice(currentLine->text, curTextLen, charIndex, numChars, "", 0);
         memmove(currentLine->text + charIndex, currentLine->text + charIndex + numChars,
-                curTextLen - numChars + 1); // null-terminator
+                curTextLen - charIndex - numChars + 1); // null-terminator
 
-        std::cout << "Deleted " << numChars << " characters from cursor position." << std::endl;
-        moveCursor(cursor.getLine(), charIndex);
+        logEdit(EditJournal::OP_DELETE, position, numChars);
+        placeCursor(cursor.getLine(), charIndex);
+        return true;
     }
 
-    void replaceSubstring() {
-        saveState();
-
+    // Overwrites `replacedBytes` bytes at the cursor (fewer if the line ends first) with `substring`.
+    bool applyReplace(const char *substring, int replacedBytes) {
         if (!currentLine) {
-            std::cout << "No current line to replace in." << std::endl;
-            return;
+            return false;
         }
-
-        char substring[31];
-        getUserInputString("Enter the substring to insert (up to 30 symbols):", substring, 31);
-
         int substringLen = strlen(substring);
         int charIndex = cursor.getChar();
         int curTextLen = strlen(currentLine->text);
 
-        if ((curTextLen - charIndex < substringLen) &&
-            !ensureCapacity(currentLine, substringLen - (curTextLen - charIndex))) {
-            return;
+        if (charIndex > curTextLen) {
+            std::cout << "Cursor position out of bounds." << std::endl;
+            return false;
         }
 
-        int newLength = charIndex + substringLen;
-        if (newLength >= curTextLen) {
-            currentLine->text[newLength] = '\0';
+        replacedBytes = std::min(replacedBytes, curTextLen - charIndex);
+        if (substringLen > replacedBytes && !ensureCapacity(currentLine, substringLen - replacedBytes)) {
+            return false;
         }
+        Cursor position = cursor;
+        saveState();
 
+        textStats.splice(currentLine->text, curTextLen, charIndex, replacedBytes, substring, substringLen);
+        memmove(currentLine->text + charIndex + substringLen, currentLine->text + charIndex + replacedBytes,
+                curTextLen - charIndex - replacedBytes + 1);
         memcpy(currentLine->text + charIndex, substring, substringLen);
 
-        std::cout << "Substring \"" << substring << "\" was inserted with replacement successfully at cursor position."
-                  << std::endl;
-        moveCursor(cursor.getLine(), charIndex + substringLen);
+        logEdit(EditJournal::OP_REPLACE, position, replacedBytes, substring);
+        placeCursor(cursor.getLine(), charIndex + substringLen);
+        return true;
     }
 
-    void copyText() {
+    bool applyCopy(int numChars) {
         if (!currentLine) {
-            std::cout << "No current line to copy from." << std::endl;
-            return;
+            return false;
         }
-
-        int numChars = getUserInputInt("Enter the number of symbols to copy: ");
         int charIndex = cursor.getChar();
         int curTextLen = strlen(currentLine->text);
 
-        if (charIndex + numChars > curTextLen) {
+        if (numChars < 0 || numChars > curTextLen - charIndex) { // charIndex + numChars could overflow
             std::cout
                     << "The number of characters to copy exceeds the length of the line."
                     << std::endl;
-            return;
+            return false;
         }
 
-        delete[] clipboard;
-        clipboard = new char[numChars + 1];
-        strncpy(clipboard, currentLine->text + charIndex, numChars);
-        clipboard[numChars] = '\0';
-
-        std::cout << "Copied text: " << clipboard << std::endl;
-        moveCursor(cursor.getLine(), charIndex + numChars);
+        setClipboard(currentLine->text + charIndex, numChars); // not journaled: the document is unchanged
+        placeCursor(cursor.getLine(), charIndex + numChars);
+        return true;
     }
 
-    void pasteText() {
-        saveState();
-
-        if (!clipboard) {
-            std::cout << "Clipboard is empty. Copy some text first." << std::endl;
-            return;
-        }
-
+    bool applyPaste(const char *content) {
         if (!currentLine) {
-            std::cout << "No current line to paste into." << std::endl;
-            return;
+            return false;
         }
-
-        int clipboardLen = strlen(clipboard);
+        int contentLen = strlen(content);
         int charIndex = cursor.getChar();
         int curTextLen = strlen(currentLine->text);
 
-        if (!ensureCapacity(currentLine, clipboardLen)) {
-            return;
+        if (charIndex > curTextLen) {
+            std::cout << "Cursor position out of bounds." << std::endl;
+            return false;
         }
 
-        memmove(currentLine->text + charIndex + clipboardLen, currentLine->text + charIndex,
+        if (!ensureCapacity(currentLine, contentLen)) {
+            return false;
+        }
+        Cursor position = cursor;
+        saveState();
+
+        textStats.splice(currentLine->text, curTextLen, charIndex, 0, content, contentLen);
+        memmove(currentLine->text + charIndex + contentLen, currentLine->text + charIndex,
                 curTextLen - charIndex + 1);
-        memcpy(currentLine->text + charIndex, clipboard, clipboardLen);
-        currentLine->text[curTextLen + clipboardLen] = '\0';
+        memcpy(currentLine->text + charIndex, content, contentLen);
+        currentLine->text[curTextLen + contentLen] = '\0';
+        Instrumentation::recordCopy(contentLen);
 
-        std::cout << "Pasted text: " << clipboard << std::endl;
-        moveCursor(cursor.getLine(), charIndex + clipboardLen);
+        logEdit(EditJournal::OP_PASTE, position, 0, content);
+        placeCursor(cursor.getLine(), charIndex + contentLen);
+        return true;
     }
 
-    void cutText() {
-        saveState();
-
+    bool applyCut(int numChars) {
         if (!currentLine) {
-            std::cout << "No current line to cut from." << std::endl;
-            return;
+            return false;
         }
-
-        int numChars = getUserInputInt("Enter the number of symbols to cut: ");
         int charIndex = cursor.getChar();
         int curTextLen = strlen(currentLine->text);
 
-        if (charIndex + numChars > curTextLen) {
+        if (numChars < 0 || numChars > curTextLen - charIndex) { // charIndex + numChars could overflow
             std::cout << "The number of characters to cut exceeds the length of the line." << std::endl;
-            return;
+            return false;
         }
+        Cursor position = cursor;
+        saveState();
 
-        delete[] clipboard;
-        clipboard = new char[numChars + 1];
-        strncpy(clipboard, currentLine->text + charIndex, numChars);
-        clipboard[numChars] = '\0';
-
+        setClipboard(currentLine->text + charIndex, numChars);
+        textStats.splice(currentLine->text, curTextLen, charIndex, numChars, "", 0);
         memmove(currentLine->text + charIndex, currentLine->text + charIndex + numChars,
                 curTextLen - numChars - charIndex + 1);
 
-        std::cout << "Cut text: " << clipboard << std::endl;
-        moveCursor(cursor.getLine(), charIndex);
+        logEdit(EditJournal::OP_CUT, position, numChars);
+        placeCursor(cursor.getLine(), charIndex);
+        return true;
     }
 
-    void encryptFile() {
-        processFile(true);
+    // Adds bytes read from a followed file to the end of the text. With `continueLast` the bytes up to the first
+    // '\n' finish the last line, which the file left without one. `startStep` saves the text for undo first; the
+    // later batches of the same session join that step. The bytes go to the journal as they are.
+    void applyFollow(const char *data, size_t size, bool continueLast, bool startStep) {
+        if (size == 0) {
+            return;
+        }
+        Cursor position = cursor;
+        if (startStep) {
+            saveState();
+        }
+        const char *rest = data;
+        size_t restSize = size;
+        LineNode *last = continueLast ? text.lastLine() : nullptr;
+        if (last) {
+            const char *newline = static_cast<const char *>(memchr(data, '\n', size));
+            size_t length = newline ? newline - data : size;
+            continueLine(last, data, length, newline != nullptr);
+            size_t used = newline ? length + 1 : size;
+            rest += used;
+            restSize -= used;
+        }
+        BlockBuilder builder(text);
+        builder.addBytes(rest, restSize);
+        builder.finish();
+        textStats.add(builder.getStats());
+        followPartial = data[size - 1] != '\n';
+        if (!currentLine) {
+            placeCursor(0, 0);
+        }
+        logEdit(EditJournal::OP_FOLLOW, position, (last ? FOLLOW_CONTINUES_LINE : 0) | (startStep ? FOLLOW_STARTS_STEP : 0),
+                std::string(data, size));
     }
 
-    void decryptFile() {
-        processFile(false);
+    // Replaces the text by the result of `operation` as a single undo step and moves the cursor to the start.
+    bool applyLineOperation(const LineOperation &operation) {
+        Cursor position = cursor;
+        Text result;
+        TextStats resultStats;
+        size_t lineCount = 0;
+        bool ok;
+        {
+            BlockBuilder builder(result);
+            ok = operation.run(text.getHead(), builder, lineCount);
+            builder.finish();
+            resultStats = builder.getStats();
+        }
+        if (!ok) {
+            std::cout << "The operation failed: the text could not be read or a temporary sort file could not be "
+                         "written. The text is unchanged." << std::endl;
+            return false;
+        }
+        saveState();
+        freeList(text.getHead());
+        text.setHead(result.getHead());
+        result.setHead(nullptr);
+        textStats = resultStats;
+        if (!text.getHead()) {
+            text.appendLine("");
+            textStats.addLine("", 0);
+        }
+        columns.clear();
+        currentLine = nullptr;
+        logEdit(EditJournal::OP_LINES, position, operation.encode(), operation.pattern.c_str());
+        placeCursor(0, 0);
+        return true;
     }
 
-    void undo() {
-        if (undoStack.empty()) {
-            std::cout << "No actions to undo." << std::endl;
-            return;
+    bool applyUndo() {
+        if (undoStack.empty() && !loadUndoSegment()) {
+            return false;
         }
+        Cursor position = cursor;
         saveCurrentStateForRedo();
-        std::pair<LineNode *, Cursor> state = undoStack.top();
-        undoStack.pop();
+        UndoEntry state = undoStack.back();
+        undoStack.pop_back();
         restoreState(state);
-        std::cout << "Undo operation completed successfully." << std::endl;
+        releaseEntry(state);
+        logEdit(EditJournal::OP_UNDO, position, 0);
+        return true;
     }
 
-    void redo() {
+    bool applyRedo() {
         if (redoStack.empty()) {
-            std::cout << "No actions to redo." << std::endl;
-            return;
+            return false;
         }
+        Cursor position = cursor;
         saveCurrentStateForUndo();
-        std::pair<LineNode *, Cursor> state = redoStack.top();
-        redoStack.pop();
+        UndoEntry state = redoStack.back();
+        redoStack.pop_back();
         restoreState(state);
-        std::cout << "Redo operation completed successfully." << std::endl;
+        releaseEntry(state);
+        logEdit(EditJournal::OP_REDO, position, 0);
+        return true;
     }
 
-    void setCursorPosition() {
-        int lineIndex = getUserInputInt("Enter the line index: ") - 1;
-        int charIndex = getUserInputInt("Enter the character index: ") - 1;
+    void setClipboard(const char *source, int length) {
+        delete[] clipboard;
+        clipboard = new char[length + 1];
+        strncpy(clipboard, source, length);
+        clipboard[length] = '\0';
+        Instrumentation::recordAllocation(length + 1);
+        Instrumentation::recordCopy(length);
+    }
 
-        if (lineIndex < 0 || charIndex < 0) {
-            std::cout << "Line and character indices must be greater than 0." << std::endl;
+    void saveState() {
+        if (!keepHistory) {
             return;
         }
+        undoStack.push_back(makeEntry());
+        clearHistory(redoStack);
+        spillUndoHistory();
+    }
 
-        LineNode *curLine = text.getHead();
-        int currentLineIndex = 0;
+    void saveCurrentStateForUndo() {
+        undoStack.push_back(makeEntry());
+        spillUndoHistory();
+    }
 
-        while (curLine && currentLineIndex < lineIndex) {
-            curLine = curLine->next;
-            ++currentLineIndex;
+    size_t undoDepth() const {
+        size_t depth = undoStack.size();
+        for (const UndoSegment &segment: undoSegments) {
+            depth += segment.entries;
         }
+        return depth;
+    }
 
-        if (!curLine) {
-            std::cout << "Line index out of bounds." << std::endl;
+    // Writes the oldest entries to disk once the history outgrows the window by a whole batch.
+    void spillUndoHistory() {
+        if (undoWindow == 0 || undoStack.size() < undoWindow + UNDO_SPILL_BATCH) {
+            return;
+        }
+        UndoSegment segment{undoSegmentPrefix(GetCurrentProcessId()) + std::to_string(undoSpillCount++),
+                            UNDO_SPILL_BATCH};
+        std::error_code existsError;
+        while (std::filesystem::exists(segment.path, existsError)) { // recovered from a process with the same id
+            segment.path = undoSegmentPrefix(GetCurrentProcessId()) + std::to_string(undoSpillCount++);
+        }
+        std::vector<SessionFile::List> lists;
+        for (size_t i = 0; i < UNDO_SPILL_BATCH; ++i) {
+            lists.push_back({undoStack[i].head, undoStack[i].cursor, undoStack[i].stats});
+        }
+        std::unordered_map<const ColdBlock *, uint64_t> copied;
+        if (!SessionFile::save(segment.path.c_str(), lists, segmentPaths(), &copied) ||
+            !EditJournal::syncFile(segment.path.c_str())) {
+            std::error_code error;
+            std::filesystem::remove(segment.path, error);
+            undoWindow = 0;
+            std::cout << "Failed to write undo history to " << segment.path << ", it is kept in memory." << std::endl;
             return;
         }
+        shareSpilledBlocks(segment.path, copied); // while the spilled entries still hold the blocks in `copied`
+        for (size_t i = 0; i < UNDO_SPILL_BATCH; ++i) {
+            releaseEntry(undoStack[i]);
+        }
+        undoStack.erase(undoStack.begin(), undoStack.begin() + UNDO_SPILL_BATCH);
+        undoSegments.push_back(segment);
+    }
 
-        int curTextLen = strlen(curLine->text);
-        if (charIndex > curTextLen) {
-            std::cout << "Character index out of bounds." << std::endl;
+    // Points the text and the history left in memory at the segment's copies of the blocks just written to it, so
+    // that later segments refer to them instead of writing them again. The heap copies go with their last user.
+    void shareSpilledBlocks(const std::string &path, const std::unordered_map<const ColdBlock *, uint64_t> &copied) {
+        MappedFile *file = copied.empty() ? nullptr : MappedFile::open(path.c_str());
+        if (!file) {
             return;
         }
-        moveCursor(lineIndex, charIndex);
+        std::unordered_map<const ColdBlock *, ColdBlock *> twins;
+        auto share = [&](LineNode *head) {
+            for (LineNode *node = head; node; node = node->next) {
+                auto twin = node->cold ? twins.find(node->cold) : twins.end();
+                if (node->cold && twin == twins.end()) {
+                    auto offset = copied.find(node->cold);
+                    if (offset == copied.end()) {
+                        continue;
+                    }
+                    twin = twins.emplace(node->cold, file->blockAt(file->data + offset->second,
+                                                                   node->cold->compressedSize, node->cold->rawSize,
+                                                                   node->cold->lineCount)).first;
+                }
+                if (twin != twins.end()) {
+                    twin->second->retain();
+                    node->cold->release();
+                    node->cold = twin->second;
+                }
+            }
+        };
+        share(text.getHead());
+        for (size_t i = UNDO_SPILL_BATCH; i < undoStack.size(); ++i) {
+            share(undoStack[i].head);
+        }
+        for (const UndoEntry &entry: redoStack) {
+            share(entry.head);
+        }
+        for (const auto &twin: twins) {
+            twin.second->release();
+        }
+        file->release();
     }
 
-    void printMenu() const {
-        std::cout << "Possible commands:\n"
-                  << "1. Append text to current line.\n"
-                  << "2. Add a new line.\n"
-                  << "3. Save the text to a file.\n"
-                  << "4. Load the text from a file.\n"
-                  << "5. Print the text.\n"
-                  << "6. Insert a substring into the text.\n"
-                  << "7. Search for a substring in the text.\n"
-                  << "8. Delete substring.\n"
-                  << "9. Insert text with replacement at a specified position.\n"
-                  << "10. Copy text.\n"
-                  << "11. Paste text.\n"
-                  << "12. Cut text.\n"
-                  << "13. Encrypt file.\n"
-                  << "14. Decrypt file.\n"
-                  << "15. Undo last action.\n"
-                  << "16. Redo last undone action.\n";
+    // Reads the newest spilled batch back in below the entries in memory. Its blocks stay mapped from the file
+    // and from the older segments it refers to, and are the very blocks the text still uses; the file is removed
+    // once nothing maps it and the journal has moved past it.
+    bool loadUndoSegment() {
+        if (undoSegments.empty()) {
+            return false;
+        }
+        UndoSegment segment = undoSegments.back();
+        undoSegments.pop_back();
+        std::vector<SessionFile::List> lists;
+        bool loaded = SessionFile::load(segment.path.c_str(), lists);
+        retiredSegments.push_back(segment.path);
+        if (!loaded || lists.size() != segment.entries) {
+            for (const SessionFile::List &list: lists) {
+                freeList(list.head);
+            }
+            clearUndoSegments(); // older entries could not be reached without this one
+            std::cout << "Failed to read undo history from " << segment.path << ", older steps are lost." << std::endl;
+            return false;
+        }
+        std::vector<UndoEntry> entries;
+        for (size_t i = 0; i < lists.size(); ++i) {
+            entries.push_back({lists[i].head, lists[i].cursor, 0, lists[i].stats});
+        }
+        undoStack.insert(undoStack.begin(), entries.begin(), entries.end());
+        return true;
     }
 
-    void publicClearInputBuffer(const char *errorMessage) {
-        clearInputBuffer(errorMessage);
+    // Appends the whole undo history, oldest first, to `lists`. Spilled entries are mapped from their files;
+    // their lists are also added to `mapped` and must be freed by the caller.
+    bool appendHistory(std::vector<SessionFile::List> &lists, std::vector<LineNode *> &mapped) const {
+        for (const UndoSegment &segment: undoSegments) {
+            std::vector<SessionFile::List> loaded;
+            if (!SessionFile::load(segment.path.c_str(), loaded)) {
+                return false;
+            }
+            for (const SessionFile::List &list: loaded) {
+                lists.push_back(list);
+                mapped.push_back(list.head);
+            }
+        }
+        for (const UndoEntry &entry: undoStack) {
+            lists.push_back({entry.head, entry.cursor, entry.stats});
+        }
+        return true;
     }
 
-    bool publicIsValidCommand(char *line, int &command) {
-        return isValidCommand(line, command);
+    // Segment files are named after the process that wrote them, so editors sharing a directory keep apart.
+    static std::string undoSegmentPrefix(unsigned long processId) {
+        return std::string(journalPath()) + ".undo-" + std::to_string(processId) + "-";
     }
 
-    void publicProcessCommand(int command) {
-        processCommand(command);
+    // Removes the segments left by the editor that wrote the recovered or discarded journal, except those
+    // taken over by this one. Nothing is removed while that editor is still running.
+    void removeUndoSegmentsOf(int processId) {
+        HANDLE owner = OpenProcess(SYNCHRONIZE, FALSE, static_cast<DWORD>(processId));
+        if (owner) {
+            bool running = WaitForSingleObject(owner, 0) == WAIT_TIMEOUT;
+            CloseHandle(owner);
+            if (running && static_cast<DWORD>(processId) != GetCurrentProcessId()) {
+                return;
+            }
+        }
+        std::filesystem::path prefix = std::filesystem::absolute(undoSegmentPrefix(static_cast<DWORD>(processId)));
+        std::error_code error;
+        std::filesystem::directory_iterator file(prefix.parent_path(), error);
+        for (; !error && file != std::filesystem::directory_iterator(); file.increment(error)) {
+            if (file->path().string().rfind(prefix.string(), 0) != 0) {
+                continue;
+            }
+            auto inUse = [&file](const std::string &path) {
+                std::error_code sameError;
+                return std::filesystem::equivalent(file->path(), path, sameError);
+            };
+            if (std::none_of(undoSegments.begin(), undoSegments.end(),
+                             [&inUse](const UndoSegment &segment) { return inUse(segment.path); }) &&
+                std::none_of(retiredSegments.begin(), retiredSegments.end(), inUse)) {
+                std::error_code removeError;
+                std::filesystem::remove(file->path(), removeError);
+            }
+        }
     }
 
-private:
-    Text text;
-    LineNode *currentLine;
-    std::stack<std::pair<LineNode *, Cursor>> undoStack;
-    std::stack<std::pair<LineNode *, Cursor>> redoStack;
-    Cursor cursor;
-    char *clipboard;
+    void clearUndoSegments() {
+        for (const UndoSegment &segment: undoSegments) {
+            retiredSegments.push_back(segment.path);
+        }
+        undoSegments.clear();
+    }
 
-    void saveState() {
-        undoStack.push({cloneList(text.getHead()), cursor});
-        while (!redoStack.empty()) {
-            freeList(redoStack.top().first);
-            redoStack.pop();
+    // Segments still mapped by blocks in use stay retired until a later call.
+    void removeRetiredSegments() {
+        std::vector<std::string> mapped;
+        for (const std::string &path: retiredSegments) {
+            std::error_code error;
+            if (MappedFile::isOpen(path.c_str())) {
+                mapped.push_back(path);
+            } else {
+                std::filesystem::remove(path, error);
+            }
         }
+        retiredSegments.swap(mapped);
     }
 
-    void saveCurrentStateForUndo() {
-        LineNode *state = cloneList(text.getHead());
-        undoStack.push({state, cursor});
+    // A segment only refers to older ones, which are read back after it, so none of them is retired before it.
+    std::vector<std::string> segmentPaths() const {
+        std::vector<std::string> paths;
+        for (const UndoSegment &segment: undoSegments) {
+            paths.push_back(segment.path);
+        }
+        return paths;
     }
 
     void saveCurrentStateForRedo() {
-        LineNode *state = cloneList(text.getHead());
-        redoStack.push({state, cursor});
+        redoStack.push_back(makeEntry());
+    }
+
+    void clearHistory(std::vector<UndoEntry> &history) {
+        for (const UndoEntry &entry: history) {
+            releaseEntry(entry);
+        }
+        history.clear();
     }
 
-    LineNode *cloneList(LineNode *head) {
+    UndoEntry makeEntry() {
+        UndoEntry entry = {cloneList(text.getHead()), cursor, 0, textStats};
+        if (Instrumentation::enabled) {
+            for (LineNode *node = entry.head; node; node = node->next) {
+                entry.bytes += sizeof(LineNode) + node->capacity;
+            }
+            Instrumentation::addUndoMemory(entry.bytes);
+        }
+        return entry;
+    }
+
+    void releaseEntry(const UndoEntry &entry) {
+        freeList(entry.head);
+        Instrumentation::removeUndoMemory(entry.bytes);
+    }
+
+    LineNode *cloneList(const LineNode *head) const {
         if (!head) {
             return nullptr;
         }
-        return new LineNode(*head);
+        LineNode *copy = new LineNode(*head);
+        if (Instrumentation::enabled) {
+            for (LineNode *node = copy; node; node = node->next) {
+                if (!node->cold) {
+                    Instrumentation::recordAllocation(node->capacity);
+                    Instrumentation::recordCopy(strlen(node->text) + 1);
+                }
+            }
+        }
+        return copy;
     }
 
-    void restoreState(const std::pair<LineNode *, Cursor> &state) {
+    void restoreState(const UndoEntry &state) {
         freeList(text.getHead());
-        text.setHead(cloneList(state.first));
-        cursor = state.second;
+        columns.clear();
+        text.setHead(cloneList(state.head));
+        textStats = state.stats;
+        cursor = state.cursor;
 
-        currentLine = text.getHead();
-        int lineIndex = 0;
-        while (currentLine && lineIndex < cursor.getLine()) {
-            currentLine = currentLine->next;
-            lineIndex++;
-        } // restore the state of the text editor to a previous state that's stored in a stack
+        currentLine = text.lineAt(cursor.getLine()); // restore the state of the text editor to a previous state that's stored in a stack
     }
 
     void freeList(LineNode *head) {
@@ -755,7 +5033,7 @@ private:
     bool isValidCommand(char *line, int &command) {
         if (isInteger(line)) {
             command = atoi(line);
-            if (command >= 1 && command <= 16) {
+            if (command >= 1 && command <= COMMAND_COUNT) {
                 return true;
             }
         }
@@ -778,6 +5056,8 @@ private:
             }
 
             strcpy(newBuffer, curLine->text);
+            Instrumentation::recordAllocation(newLength);
+            Instrumentation::recordCopy(currentLength + 1);
             delete[] curLine->text;
             curLine->text = newBuffer;
             curLine->capacity = newLength;
@@ -788,6 +5068,7 @@ private:
     int getUserInputInt(const char *prompt) {
         char input[BUFFER_SIZE];
         int value;
+        long long start = Instrumentation::enabled ? Instrumentation::now() : 0;
 
         while (true) {
             std::cout << prompt << std::endl;
@@ -805,10 +5086,14 @@ private:
                 std::cout << "Invalid input. Please enter an integer value." << std::endl;
             }
         }
+        if (start) {
+            inputNanoseconds += Instrumentation::now() - start;
+        }
         return value;
     }
 
     void getUserInputString(const char *prompt, char *output, int maxLength) const {
+        long long start = Instrumentation::enabled ? Instrumentation::now() : 0;
         while (true) {
             std::cout << prompt << std::endl;
             std::cin.getline(output, maxLength);
@@ -824,6 +5109,9 @@ private:
                 break;
             }
         }
+        if (start) {
+            inputNanoseconds += Instrumentation::now() - start;
+        }
     }
 
     void getUserPath(const char *prompt, char* path, PathValidator &validator, bool checkExistence, const char* otherPath = nullptr) {
@@ -863,20 +5151,80 @@ private:
         std::cout << "Operation on file completed successfully." << std::endl;
     }
 
+    void displayCursor() {
+        if (!utf8Mode || !currentLine) {
+            cursor.display();
+            return;
+        }
+        Cursor shown(cursor.getLine(), columns.column(currentLine, cursor.getChar()));
+        shown.display();
+    }
+
+    size_t symbolCount(const char *input) const {
+        size_t length = strlen(input);
+        if (!utf8Mode) {
+            return length;
+        }
+        size_t pos = 0;
+        return Utf8::advance(input, pos, length, ColumnIndex::NOT_FOUND);
+    }
+
+    // Converts a count of characters from the cursor on into bytes. A count that runs past the end
+    // of the line converts to more bytes than the line has left, so the bounds checks still apply.
+    int byteCount(int count) {
+        if (!utf8Mode) {
+            return count;
+        }
+        size_t end = columns.byteOffset(currentLine, columns.column(currentLine, cursor.getChar()) + count);
+        if (end == ColumnIndex::NOT_FOUND) {
+            return strlen(currentLine->text) - cursor.getChar() + 1;
+        }
+        return end - cursor.getChar();
+    }
+
+    void getUserSubstring(const char *prompt, char *output) const {
+        while (true) {
+            getUserInputString(prompt, output, SUBSTRING_BUFFER_SIZE);
+            if (symbolCount(output) <= MAX_SUBSTRING_SYMBOLS) {
+                return;
+            }
+            std::cout << "Input exceeds " << MAX_SUBSTRING_SYMBOLS << " symbols. Please enter a shorter input."
+                      << std::endl;
+        }
+    }
+
     void moveCursor(int lineIndex, int charIndex) {
-        cursor.move(lineIndex, charIndex);
+        placeCursor(lineIndex, charIndex);
+        displayCursor();
+    }
 
-        currentLine = text.getHead();
-        int currentLineIndex = 0;
-        while (currentLine && currentLineIndex < lineIndex) {
-            currentLine = currentLine->next;
-            currentLineIndex++;
+    bool placeCursorChecked(int lineIndex, int charIndex) {
+        LineNode *line = lineIndex >= 0 ? text.lineAt(lineIndex) : nullptr;
+        if (!line || charIndex < 0 || charIndex > static_cast<int>(strlen(line->text))) {
+            return false;
         }
+        placeCursor(lineIndex, charIndex);
+        return true;
+    }
+
+    void placeCursor(int lineIndex, int charIndex) {
+        cursor.move(lineIndex, charIndex);
 
-        cursor.display();
+        currentLine = text.lineAt(lineIndex);
     }
 
     void processCommand(int command) {
+        std::unique_lock<std::shared_mutex> lock(documentMutex);
+        long long start = Instrumentation::enabled ? Instrumentation::now() : 0;
+        inputNanoseconds = 0;
+        dispatchCommand(command, lock);
+        if (Instrumentation::enabled && start) {
+            Instrumentation::recordCommand(command, Instrumentation::now() - start - inputNanoseconds);
+        }
+    }
+
+    // `lock` holds the document lock; only follow mode lets go of it, while it waits for the file to grow.
+    void dispatchCommand(int command, std::unique_lock<std::shared_mutex> &lock) {
         switch (command) {
             case 1:
                 appendText();
@@ -926,15 +5274,491 @@ private:
             case 16:
                 redo();
                 break;
+            case 17:
+                printStatistics();
+                break;
+            case 18:
+                saveSession();
+                break;
+            case 19:
+                loadSession();
+                break;
+            case 20:
+                configureAutosave();
+                break;
+            case 21:
+                toggleUtf8Mode();
+                break;
+            case 22:
+                showDiff();
+                break;
+            case 23:
+                transformLines();
+                break;
+            case 24:
+                showTextStats();
+                break;
+            case 25:
+                followFile(lock);
+                break;
             default:
-                std::cout << "Unexpected command received. Please enter a number from 1 to 14." << std::endl;
+                std::cout << "Unexpected command received. Please enter a number from 1 to " << COMMAND_COUNT << "."
+                          << std::endl;
+                break;
+        }
+    }
+};
+
+// Serves one document to local clients over a Unix domain socket, so several tools share a single
+// copy of it. One thread runs the event loop: it accepts connections, splits incoming bytes into
+// request lines and writes replies. SEARCH, READ and SAVE go to a pool of reader threads that scan
+// pinned document snapshots, in parallel with each other and with edits; OPEN, INSERT and DELETE
+// go to a single writer thread, so edits apply one at a time in arrival order. A connection has at most one request in
+// flight, which keeps its replies in order. Workers queue their replies and wake the loop through
+// a socket connected to the loop's own listener.
+//
+// Protocol, one request per line and one reply per request, lines and positions counting from 1:
+//   OPEN <path>                       -> OK
+//   SEARCH <text>                     -> OK <n>, then n lines "<line> <position>"
+//   READ <first line> <count>         -> OK <n>, then n text lines
+//   INSERT <line> <position> <text>   -> OK
+//   DELETE <line> <position> <count>  -> OK
+//   SAVE <path>                       -> OK
+// A request that fails is answered with ERR <reason>.
+class EditorServer {
+public:
+    static const size_t MAX_REQUEST_LENGTH = 1 << 16;
+    static const int RECEIVE_BUFFER_SIZE = 1 << 16;
+    static const size_t WAKE_TOKEN_SIZE = 16;
+    static const int WAKE_TOKEN_TIMEOUT_MS = 1000;
+
+    explicit EditorServer(TextManager &manager) : document(manager), listener(INVALID_SOCKET),
+                                                  wakeSender(INVALID_SOCKET), wakeReceiver(INVALID_SOCKET),
+                                                  wakePending(false), nextConnection(0) {}
+
+    ~EditorServer() {
+        readQueue.close();
+        writeQueue.close();
+        for (std::thread &worker: workers) {
+            worker.join();
+        }
+        for (auto &connection: connections) {
+            closesocket(connection.second.socket);
+        }
+        for (SOCKET own: {listener, wakeSender, wakeReceiver}) {
+            if (own != INVALID_SOCKET) {
+                closesocket(own);
+            }
+        }
+        if (!path.empty()) {
+            std::error_code error;
+            std::filesystem::remove(path, error);
+        }
+        WSACleanup();
+    }
+
+    // Listens on `socketPath` and serves requests until the event loop fails; returns false if
+    // the socket cannot be set up.
+    bool run(const char *socketPath) {
+        WSADATA data;
+        if (WSAStartup(MAKEWORD(2, 2), &data) != 0) {
+            std::cout << "Failed to initialize sockets." << std::endl;
+            return false;
+        }
+
+        SOCKADDR_UN address = {};
+        address.sun_family = AF_UNIX;
+        if (strlen(socketPath) >= sizeof(address.sun_path)) {
+            std::cout << "The socket path is too long." << std::endl;
+            return false;
+        }
+        strcpy(address.sun_path, socketPath);
+        std::error_code error;
+        std::filesystem::remove(socketPath, error); // left behind by a server that did not exit cleanly
+
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener == INVALID_SOCKET ||
+            bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == SOCKET_ERROR ||
+            listen(listener, SOMAXCONN) == SOCKET_ERROR) {
+            std::cout << "Failed to listen on " << socketPath << "." << std::endl;
+            return false;
+        }
+        path = socketPath;
+
+        if (!connectWakePair()) {
+            std::cout << "Failed to set up the server wakeup socket." << std::endl;
+            return false;
+        }
+        setNonBlocking(listener);
+        setNonBlocking(wakeReceiver);
+
+        unsigned readers = std::max(2u, std::thread::hardware_concurrency());
+        for (unsigned i = 0; i < readers; ++i) {
+            workers.emplace_back(&EditorServer::serve, this, std::ref(readQueue));
+        }
+        workers.emplace_back(&EditorServer::serve, this, std::ref(writeQueue));
+
+        std::cout << "Serving on " << socketPath << " with " << readers << " reader threads." << std::endl;
+        return eventLoop();
+    }
+
+private:
+    struct Job {
+        unsigned long long connection;
+        std::string request;
+    };
+
+    class JobQueue {
+    public:
+        JobQueue() : closed(false) {}
+
+        void push(Job job) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                jobs.push_back(std::move(job));
+            }
+            available.notify_one();
+        }
+
+        // Blocks until a job is available; returns false once the queue is closed.
+        bool pop(Job &job) {
+            std::unique_lock<std::mutex> lock(mutex);
+            available.wait(lock, [this] { return closed || !jobs.empty(); });
+            if (jobs.empty()) {
+                return false;
+            }
+            job = std::move(jobs.front());
+            jobs.pop_front();
+            return true;
+        }
+
+        void close() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                closed = true;
+            }
+            available.notify_all();
+        }
+
+    private:
+        std::mutex mutex;
+        std::condition_variable available;
+        std::deque<Job> jobs;
+        bool closed;
+    };
+
+    struct Connection {
+        SOCKET socket;
+        std::string input;
+        std::string output;
+        std::deque<std::string> requests; // received but not yet handed to a worker
+        bool busy;
+    };
+
+    TextManager &document;
+    std::string path;
+    SOCKET listener;
+    SOCKET wakeSender;
+    SOCKET wakeReceiver;
+    JobQueue readQueue;
+    JobQueue writeQueue;
+    std::vector<std::thread> workers;
+    std::mutex repliesMutex;
+    std::vector<Job> replies; // finished requests, with the reply in place of the request
+    std::atomic<bool> wakePending;
+    std::unordered_map<unsigned long long, Connection> connections; // only touched by the event loop
+    unsigned long long nextConnection;
+
+    static void setNonBlocking(SOCKET socket) {
+        u_long nonBlocking = 1;
+        ioctlsocket(socket, FIONBIO, &nonBlocking);
+    }
+
+    // Windows has no socketpair(), so the wakeup pair is connected through a listener of its own at a random
+    // path in the temporary directory, which goes away as soon as the pair is connected. A random token sent
+    // through the pair proves that the accepted socket is wakeSender and not some other client.
+    bool connectWakePair() {
+        std::random_device random;
+        std::string token;
+        while (token.size() < WAKE_TOKEN_SIZE) {
+            uint32_t word = random();
+            token.append(reinterpret_cast<const char *>(&word), sizeof(word));
+        }
+        std::error_code error;
+        std::filesystem::path directory = std::filesystem::temp_directory_path(error);
+        std::string name = "simple-text-editor-" + std::to_string(GetCurrentProcessId()) + "-" +
+                           std::to_string(random()) + ".wake";
+        std::string wakePath = error ? name : (directory / name).string();
+
+        SOCKADDR_UN address = {};
+        address.sun_family = AF_UNIX;
+        if (wakePath.size() >= sizeof(address.sun_path)) {
+            return false;
+        }
+        strcpy(address.sun_path, wakePath.c_str());
+        SOCKET wakeListener = socket(AF_UNIX, SOCK_STREAM, 0);
+        bool connected = wakeListener != INVALID_SOCKET &&
+                         bind(wakeListener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != SOCKET_ERROR &&
+                         listen(wakeListener, 1) != SOCKET_ERROR &&
+                         (wakeSender = socket(AF_UNIX, SOCK_STREAM, 0)) != INVALID_SOCKET &&
+                         connect(wakeSender, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != SOCKET_ERROR &&
+                         (wakeReceiver = accept(wakeListener, nullptr, nullptr)) != INVALID_SOCKET;
+        if (wakeListener != INVALID_SOCKET) {
+            closesocket(wakeListener);
+        }
+        std::filesystem::remove(wakePath, error);
+        if (!connected || send(wakeSender, token.data(), WAKE_TOKEN_SIZE, 0) != static_cast<int>(WAKE_TOKEN_SIZE)) {
+            return false;
+        }
+
+        std::string received;
+        char buffer[WAKE_TOKEN_SIZE];
+        WSAPOLLFD polled = {wakeReceiver, POLLIN, 0};
+        while (received.size() < WAKE_TOKEN_SIZE && WSAPoll(&polled, 1, WAKE_TOKEN_TIMEOUT_MS) > 0) {
+            int count = recv(wakeReceiver, buffer, static_cast<int>(WAKE_TOKEN_SIZE - received.size()), 0);
+            if (count <= 0) {
                 break;
+            }
+            received.append(buffer, count);
+        }
+        return received == token;
+    }
+
+    bool eventLoop() {
+        std::vector<WSAPOLLFD> polled;
+        std::vector<unsigned long long> polledIds;
+        while (true) {
+            polled.assign({{listener, POLLIN, 0}, {wakeReceiver, POLLIN, 0}});
+            polledIds.clear();
+            for (auto &entry: connections) {
+                short events = POLLIN;
+                if (!entry.second.output.empty()) {
+                    events |= POLLOUT;
+                }
+                polled.push_back({entry.second.socket, events, 0});
+                polledIds.push_back(entry.first);
+            }
+
+            if (WSAPoll(polled.data(), polled.size(), -1) == SOCKET_ERROR) {
+                std::cout << "Server event loop failed with error " << WSAGetLastError() << "." << std::endl;
+                return false;
+            }
+            if (polled[1].revents) {
+                collectReplies();
+            }
+            if (polled[0].revents & POLLIN) {
+                acceptConnections();
+            }
+            for (size_t i = 0; i < polledIds.size(); ++i) {
+                short events = polled[i + 2].revents;
+                auto found = connections.find(polledIds[i]);
+                if (!events || found == connections.end()) {
+                    continue;
+                }
+                bool open = true;
+                if (events & POLLOUT) {
+                    open = flush(found->second);
+                }
+                if (open && (events & ~POLLOUT)) { // errors and hang-ups show up as a failed receive
+                    open = receive(polledIds[i], found->second);
+                }
+                if (!open) {
+                    closesocket(found->second.socket);
+                    connections.erase(found);
+                }
+            }
+        }
+    }
+
+    void acceptConnections() {
+        SOCKET client;
+        while ((client = accept(listener, nullptr, nullptr)) != INVALID_SOCKET) {
+            setNonBlocking(client);
+            connections[nextConnection++] = {client, "", "", {}, false};
+        }
+    }
+
+    // Returns false when the connection has closed or sent a request that is too long.
+    bool receive(unsigned long long id, Connection &connection) {
+        char buffer[RECEIVE_BUFFER_SIZE];
+        int received = recv(connection.socket, buffer, sizeof(buffer), 0);
+        if (received == 0 || (received == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK)) {
+            return false;
+        }
+        if (received < 0) {
+            return true;
+        }
+
+        connection.input.append(buffer, received);
+        size_t start = 0;
+        size_t end;
+        while ((end = connection.input.find('\n', start)) != std::string::npos) {
+            size_t length = end - start;
+            if (length > 0 && connection.input[end - 1] == '\r') {
+                --length;
+            }
+            connection.requests.emplace_back(connection.input, start, length);
+            start = end + 1;
+        }
+        connection.input.erase(0, start);
+        if (connection.input.size() > MAX_REQUEST_LENGTH) {
+            return false;
+        }
+        dispatch(id, connection);
+        return true;
+    }
+
+    void dispatch(unsigned long long id, Connection &connection) {
+        if (connection.busy || connection.requests.empty()) {
+            return;
+        }
+        connection.busy = true;
+        std::string request = std::move(connection.requests.front());
+        connection.requests.pop_front();
+        bool isRead = request.compare(0, 7, "SEARCH ") == 0 || request.compare(0, 5, "READ ") == 0 ||
+                      request.compare(0, 5, "SAVE ") == 0;
+        (isRead ? readQueue : writeQueue).push({id, std::move(request)});
+    }
+
+    // Returns false when the connection has failed.
+    bool flush(Connection &connection) {
+        while (!connection.output.empty()) {
+            int sent = send(connection.socket, connection.output.data(), static_cast<int>(connection.output.size()), 0);
+            if (sent == SOCKET_ERROR) {
+                return WSAGetLastError() == WSAEWOULDBLOCK;
+            }
+            connection.output.erase(0, sent);
+        }
+        return true;
+    }
+
+    void collectReplies() {
+        char drained[64];
+        while (recv(wakeReceiver, drained, sizeof(drained), 0) > 0) {
+        }
+        wakePending = false; // a reply queued from here on sends a new wakeup
+
+        std::vector<Job> finished;
+        {
+            std::lock_guard<std::mutex> lock(repliesMutex);
+            finished.swap(replies);
+        }
+        for (Job &reply: finished) {
+            auto found = connections.find(reply.connection);
+            if (found == connections.end()) {
+                continue; // the client went away while its request ran
+            }
+            Connection &connection = found->second;
+            connection.output += reply.request;
+            connection.busy = false;
+            dispatch(reply.connection, connection);
+            if (!flush(connection)) {
+                closesocket(connection.socket);
+                connections.erase(found);
+            }
+        }
+    }
+
+    void serve(JobQueue &queue) {
+        Job job;
+        while (queue.pop(job)) {
+            job.request = handle(job.request);
+            {
+                std::lock_guard<std::mutex> lock(repliesMutex);
+                replies.push_back(std::move(job));
+            }
+            if (!wakePending.exchange(true)) {
+                char signal = 1;
+                send(wakeSender, &signal, 1, 0);
+            }
+        }
+    }
+
+    std::string handle(const std::string &request) {
+        size_t space = request.find(' ');
+        std::string command = request.substr(0, space);
+        std::string arguments = space == std::string::npos ? "" : request.substr(space + 1);
+        int values[3];
+        size_t consumed = 0;
+
+        if (command == "OPEN" && !arguments.empty()) {
+            return document.openDocument(arguments.c_str()) ? "OK\n" : "ERR cannot open " + arguments + "\n";
+        }
+        if (command == "SAVE" && !arguments.empty()) {
+            return document.writeDocument(arguments.c_str()) ? "OK\n" : "ERR cannot write " + arguments + "\n";
+        }
+        if (command == "SEARCH" && !arguments.empty()) {
+            std::vector<std::pair<int, int>> matches;
+            document.findAll(arguments.c_str(), matches);
+            std::string reply = "OK " + std::to_string(matches.size()) + "\n";
+            for (const std::pair<int, int> &match: matches) {
+                reply += std::to_string(match.first + 1) + " " + std::to_string(match.second + 1) + "\n";
+            }
+            return reply;
+        }
+        if (command == "READ" && parseIntegers(arguments, values, 2, consumed) && onlyBlanks(arguments, consumed)) {
+            std::vector<std::string> lines;
+            if (!document.readLines(values[0] - 1, values[1], lines)) {
+                return "ERR invalid range\n";
+            }
+            std::string reply = "OK " + std::to_string(lines.size()) + "\n";
+            for (const std::string &text: lines) {
+                reply += text;
+                reply += '\n';
+            }
+            return reply;
+        }
+        if (command == "INSERT" && parseIntegers(arguments, values, 2, consumed) &&
+            arguments[consumed] == ' ' && arguments[consumed + 1] != '\0') { // the text may start with spaces
+            return document.insertAt(values[0] - 1, values[1] - 1, arguments.c_str() + consumed + 1) ? "OK\n"
+                                                                                                 : "ERR invalid position\n";
+        }
+        if (command == "DELETE" && parseIntegers(arguments, values, 3, consumed) && onlyBlanks(arguments, consumed)) {
+            return document.deleteAt(values[0] - 1, values[1] - 1, values[2]) ? "OK\n" : "ERR invalid range\n";
+        }
+        return "ERR unknown request\n";
+    }
+
+    // Reads `count` blank-separated integers from the start of `arguments` like sscanf's %d, but fails on a number
+    // that does not fit in an int instead of overflowing. `consumed` is set to the end of the last number.
+    static bool parseIntegers(const std::string &arguments, int *values, int count, size_t &consumed) {
+        const char *pos = arguments.c_str();
+        for (int i = 0; i < count; ++i) {
+            char *end;
+            long long value = strtoll(pos, &end, 10); // saturates on overflow, which the range check rejects
+            if (end == pos || value < INT_MIN || value > INT_MAX) {
+                return false;
+            }
+            values[i] = static_cast<int>(value);
+            pos = end;
         }
+        consumed = pos - arguments.c_str();
+        return true;
+    }
+
+    static bool onlyBlanks(const std::string &arguments, size_t from) {
+        return arguments.find_first_not_of(" \t\r\n", from) == std::string::npos;
     }
 };
 
-int main() {
+
+int main(int argc, char *argv[]) {
+    // EDITOR_STATS=1 turns instrumentation on from the start, EDITOR_STATS_FILE=<path> additionally
+    // writes a JSON dump of the counters there on exit.
+    const char *statsFile = std::getenv("EDITOR_STATS_FILE");
+    const char *statsFlag = std::getenv("EDITOR_STATS");
+    Instrumentation::enabled = statsFile || (statsFlag && strcmp(statsFlag, "0") != 0);
+
     TextManager textManager;
+    if (argc >= 3 && strcmp(argv[1], "--serve") == 0) { // --serve <socket path> [file to open]
+        textManager.setHistoryEnabled(false); // clients cannot undo, so edits keep no copies
+        if (argc >= 4 && !textManager.openDocument(argv[3])) {
+            return 1;
+        }
+        EditorServer server(textManager);
+        return server.run(argv[2]) ? 0 : 1;
+    }
+    textManager.startJournal();
 
     std::cout << "Welcome! Enter 'm' to see available commands, 'c' to set cursor position and 'e' to exit."
               << std::endl;
@@ -955,13 +5779,18 @@ int main() {
             textManager.setCursorPosition();
         } else if (strcmp(commandLine, "e") == 0) {
             std::cout << "Okay, bye!" << std::endl;
+            textManager.closeJournal();
             break;
         } else if (textManager.publicIsValidCommand(commandLine, command)) {
             textManager.publicProcessCommand(command);
         } else {
-            std::cout << "Invalid command! Please, enter a number from 1 to 16." << std::endl;
+            std::cout << "Invalid command! Please, enter a number from 1 to " << TextManager::COMMAND_COUNT << "."
+                      << std::endl;
         }
     }
 
+    if (statsFile && !textManager.dumpStatistics(statsFile)) {
+        std::cout << "Failed to write statistics to " << statsFile << "." << std::endl;
+    }
     return 0;
 }